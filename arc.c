@@ -0,0 +1,514 @@
+/*
+    arc.c
+
+    This is part of pcb2g - pcb bitmap to G code converter
+
+    Copyright (C) 2011- 2015 Peter Popovec, popovec@fei.tuke.sk
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Arc fitting (after optimization)
+
+    Runs of polyline points are replaced by circular arc (G2/G3) if all
+    points and segments are in distance below image->arc_tolerance from
+    arc. Arc is accepted only if it does not cross copper, is not closer
+    to hole than hole_to_line and is not closer to other isolation lines
+    than replaced points (same rules as in optimizer). Arc is stored in
+    first point of run (arc, arc_cx, arc_cy), inner points are removed.
+
+*/
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#define __USE_XOPEN
+#include <math.h>
+#include "pcb2g.h"
+#include "polyline.h"
+#include "pgeom.h"
+
+#define ARC_MIN_POINTS 4	// at least 3 segments are replaced by arc
+#define ARC_MAX_POINTS 256
+
+/*
+  uniform grid over all polyline points (real coordinates), points of
+  removed runs are kept in grid, they are in arc tolerance from arc
+*/
+static struct
+{
+  double x0, y0, cell;
+  int nx, ny;
+  int *start;			// first point in cell (CSR)
+  int *item;			// point number
+  double *x, *y;
+  int *pl, *idx;		// polyline number, point number in polyline
+  int points;
+} ag;
+
+// point run of one polyline
+static struct
+{
+  struct polyline_point **p;
+  double *x, *y;
+  int n, size;
+} run;
+
+static int
+ag_cx (double x)
+{
+  x = (x - ag.x0) / ag.cell;
+  if (x < 0)
+    return 0;
+  if (x >= ag.nx)
+    return ag.nx - 1;
+  return x;
+}
+
+static int
+ag_cy (double y)
+{
+  y = (y - ag.y0) / ag.cell;
+  if (y < 0)
+    return 0;
+  if (y >= ag.ny)
+    return ag.ny - 1;
+  return y;
+}
+
+static void
+ag_build (struct image *image)
+{
+  struct polyline *ps;
+  struct polyline_point *p;
+  double x1, y1;
+  int i, k, c, *fill;
+
+  for (i = 0, ps = image->first_polyline; ps != NULL; ps = ps->next)
+    for (p = ps->points; p != NULL; p = p->next)
+      i++;
+  ag.points = i;
+  ag.x = malloc ((i + 1) * sizeof (double));
+  ag.y = malloc ((i + 1) * sizeof (double));
+  ag.pl = malloc ((i + 1) * sizeof (int));
+  ag.idx = malloc ((i + 1) * sizeof (int));
+  ag.item = malloc ((i + 1) * sizeof (int));
+  for (i = 0, k = 0, ps = image->first_polyline; ps != NULL;
+       ps = ps->next, k++)
+    for (c = 0, p = ps->points; p != NULL; p = p->next, i++, c++)
+      {
+	ag.x[i] = i2realX (image, p->x) / 2.0;
+	ag.y[i] = i2realY (image, p->y) / 2.0;
+	ag.pl[i] = k;
+	ag.idx[i] = c;
+      }
+
+  ag.x0 = x1 = ag.points ? ag.x[0] : 0;
+  ag.y0 = y1 = ag.points ? ag.y[0] : 0;
+  for (i = 1; i < ag.points; i++)
+    {
+      if (ag.x0 > ag.x[i])
+	ag.x0 = ag.x[i];
+      if (x1 < ag.x[i])
+	x1 = ag.x[i];
+      if (ag.y0 > ag.y[i])
+	ag.y0 = ag.y[i];
+      if (y1 < ag.y[i])
+	y1 = ag.y[i];
+    }
+  // about two points in one cell
+  ag.cell = sqrt (2.0 * (x1 - ag.x0) * (y1 - ag.y0) / (ag.points + 1));
+  if (ag.cell < (x1 - ag.x0) / (2.0 * ag.points + 2))
+    ag.cell = (x1 - ag.x0) / (2.0 * ag.points + 2);
+  if (ag.cell < (y1 - ag.y0) / (2.0 * ag.points + 2))
+    ag.cell = (y1 - ag.y0) / (2.0 * ag.points + 2);
+  if (ag.cell <= 0)
+    ag.cell = 1;
+  ag.nx = (x1 - ag.x0) / ag.cell + 1;
+  ag.ny = (y1 - ag.y0) / ag.cell + 1;
+
+  ag.start = calloc (ag.nx * ag.ny + 1, sizeof (int));
+  for (i = 0; i < ag.points; i++)
+    ag.start[ag_cx (ag.x[i]) + ag_cy (ag.y[i]) * ag.nx + 1]++;
+  for (c = 0; c < ag.nx * ag.ny; c++)
+    ag.start[c + 1] += ag.start[c];
+  fill = malloc ((ag.nx * ag.ny + 1) * sizeof (int));
+  memcpy (fill, ag.start, ag.nx * ag.ny * sizeof (int));
+  for (i = 0; i < ag.points; i++)
+    ag.item[fill[ag_cx (ag.x[i]) + ag_cy (ag.y[i]) * ag.nx]++] = i;
+  free (fill);
+}
+
+static void
+ag_free (void)
+{
+  free (ag.start);
+  free (ag.item);
+  free (ag.x);
+  free (ag.y);
+  free (ag.pl);
+  free (ag.idx);
+  memset (&ag, 0, sizeof (ag));
+  free (run.p);
+  free (run.x);
+  free (run.y);
+  memset (&run, 0, sizeof (run));
+}
+
+// bounding box of run points s..e
+static void
+run_box (int s, int e, double *box)
+{
+  int i;
+
+  box[0] = box[2] = run.x[s];
+  box[1] = box[3] = run.y[s];
+  for (i = s + 1; i <= e; i++)
+    {
+      if (box[0] > run.x[i])
+	box[0] = run.x[i];
+      if (box[2] < run.x[i])
+	box[2] = run.x[i];
+      if (box[1] > run.y[i])
+	box[1] = run.y[i];
+      if (box[3] < run.y[i])
+	box[3] = run.y[i];
+    }
+}
+
+/*
+  circle center fitted to points s..e (least squares, algebraic distance),
+  center is moved to perpendicular bisector of s,e (start and end of arc
+  must be in same distance from center). Coordinates are relative to
+  point s for better precision.
+*/
+static int
+arc_center (int s, int e, double *cx, double *cy)
+{
+  double a[3][4] = { {0} }, x, y, z, f, d, ux, uy, mx, my;
+  int i, j, k, r;
+
+  for (i = s; i <= e; i++)
+    {
+      x = run.x[i] - run.x[s];
+      y = run.y[i] - run.y[s];
+      z = -(x * x + y * y);
+      a[0][0] += x * x;
+      a[0][1] += x * y;
+      a[0][2] += x;
+      a[0][3] += x * z;
+      a[1][1] += y * y;
+      a[1][2] += y;
+      a[1][3] += y * z;
+      a[2][2] += 1;
+      a[2][3] += z;
+    }
+  a[1][0] = a[0][1];
+  a[2][0] = a[0][2];
+  a[2][1] = a[1][2];
+  // x^2 + y^2 + D x + E y + F = 0, gauss elimination with pivoting
+  for (i = 0; i < 3; i++)
+    {
+      for (r = i, j = i + 1; j < 3; j++)
+	if (fabs (a[j][i]) > fabs (a[r][i]))
+	  r = j;
+      for (k = 0; k < 4; k++)
+	{
+	  f = a[i][k];
+	  a[i][k] = a[r][k];
+	  a[r][k] = f;
+	}
+      if (fabs (a[i][i]) < DBL_EPSILON)
+	return 0;
+      for (j = 0; j < 3; j++)
+	if (j != i)
+	  for (f = a[j][i] / a[i][i], k = i; k < 4; k++)
+	    a[j][k] -= f * a[i][k];
+    }
+  x = -a[0][3] / a[0][0] / 2;
+  y = -a[1][3] / a[1][1] / 2;
+
+  // project center to bisector of s,e
+  mx = (run.x[e] - run.x[s]) / 2;
+  my = (run.y[e] - run.y[s]) / 2;
+  d = sqrt (mx * mx + my * my);
+  if (d == 0)
+    return 0;
+  ux = -my / d;
+  uy = mx / d;
+  d = (x - mx) * ux + (y - my) * uy;
+  *cx = run.x[s] + mx + d * ux;
+  *cy = run.y[s] + my + d * uy;
+  return isfinite (*cx) && isfinite (*cy);
+}
+
+/*
+  check if points s..e can be replaced by arc, calculate center and
+  direction (1 = counterclockwise G3, -1 = clockwise G2). Arc is below
+  180 degrees, all points and segments are in tolerance from arc.
+*/
+static int
+arc_shape (double tol, int s, int e, double *cx, double *cy, int *dir)
+{
+  int i, m = (s + e) / 2;
+  double r, cross, a, sweep = 0, dev, dev_prev, len, sag;
+
+  cross = (run.x[m] - run.x[s]) * (run.y[e] - run.y[m]) -
+    (run.y[m] - run.y[s]) * (run.x[e] - run.x[m]);
+  if (fabs (cross) < DBL_EPSILON)
+    return 0;			// straight line
+  *dir = cross > 0 ? 1 : -1;
+  if (!arc_center (s, e, cx, cy))
+    return 0;
+  r = pointToPointDistance2D (*cx, *cy, run.x[s], run.y[s]);
+
+  // whole arc must be curved over tolerance, else line is better
+  len = pointToPointDistance2D (run.x[s], run.y[s], run.x[e], run.y[e]);
+  if (len / 2 < r && r - sqrt (r * r - len * len / 4) < tol)
+    return 0;
+
+  dev_prev = 0;
+  for (i = s; i < e; i++)
+    {
+      dev = fabs (pointToPointDistance2D (*cx, *cy, run.x[i + 1],
+					  run.y[i + 1]) - r);
+      // segment to arc distance below dev + sagitta of segment
+      len = pointToPointDistance2D (run.x[i], run.y[i], run.x[i + 1],
+				    run.y[i + 1]);
+      if (len / 2 >= r)
+	return 0;
+      sag = r - sqrt (r * r - len * len / 4);
+      if ((dev > dev_prev ? dev : dev_prev) + sag > tol)
+	return 0;
+      dev_prev = dev;
+
+      // points must go around center in arc direction
+      a = atan2 ((run.x[i] - *cx) * (run.y[i + 1] - *cy) -
+		 (run.y[i] - *cy) * (run.x[i + 1] - *cx),
+		 (run.x[i] - *cx) * (run.x[i + 1] - *cx) +
+		 (run.y[i] - *cy) * (run.y[i + 1] - *cy));
+      if (a * *dir <= 0)
+	return 0;
+      sweep += fabs (a);
+    }
+  return sweep < M_PI * 0.99;
+}
+
+// point i on arc from s, angle t (radians in arc direction)
+static void
+arc_point (int s, double cx, double cy, int dir, double t, double *x,
+	   double *y)
+{
+  double dx = run.x[s] - cx, dy = run.y[s] - cy;
+
+  t *= dir;
+  *x = cx + dx * cos (t) - dy * sin (t);
+  *y = cy + dx * sin (t) + dy * cos (t);
+}
+
+// arc does not cross copper, arc is tested by short lines (below 1/2 pixel)
+static int
+arc_copper (struct image *image, int s, int e, double cx, double cy, int dir)
+{
+  double mm_x = i2realX (image, image->x) / image->x;
+  double mm_y = i2realY (image, image->y) / image->y;
+  double r, sweep, x, y;
+  int i, steps, x0, y0, x1, y1;
+
+  r = pointToPointDistance2D (cx, cy, run.x[s], run.y[s]);
+  sweep = fabs (atan2 ((run.x[s] - cx) * (run.y[e] - cy) -
+		       (run.y[s] - cy) * (run.x[e] - cx),
+		       (run.x[s] - cx) * (run.x[e] - cx) +
+		       (run.y[s] - cy) * (run.y[e] - cy)));
+  steps = r * sweep / (0.5 * (mm_x < mm_y ? mm_x : mm_y)) + 1;
+  x0 = lround (run.x[s] / mm_x);
+  y0 = lround (run.y[s] / mm_y);
+  for (i = 1; i <= steps; i++)
+    {
+      arc_point (s, cx, cy, dir, sweep * i / steps, &x, &y);
+      x1 = lround (x / mm_x);
+      y1 = lround (y / mm_y);
+      if (x1 < 0 || y1 < 0 || x1 >= image->x || y1 >= image->y)
+	return 0;
+      if (bres_line_test (image, x0, y0, x1, y1) == -1)
+	return 0;
+      x0 = x1;
+      y0 = y1;
+    }
+  return 1;
+}
+
+// arc is not closer to hole than hole_to_line
+static int
+arc_holes (struct image *image, int s, int e, double cx, double cy, int dir,
+	   double tol)
+{
+  struct hole *h;
+  double box[4], dx, dy;
+
+  run_box (s, e, box);
+  for (h = image->first_hole; h != NULL; h = h->next)
+    {
+      dx = h->fx < box[0] ? box[0] - h->fx : h->fx - box[2];
+      dy = h->fy < box[1] ? box[1] - h->fy : h->fy - box[3];
+      if (dx > h->hole_to_line + tol || dy > h->hole_to_line + tol)
+	continue;
+      if (arcToPointDistance2D (run.x[s], run.y[s], run.x[e], run.y[e],
+				cx - run.x[s], cy - run.y[s], dir > 0,
+				h->fx, h->fy) + 0.0000001 < h->hole_to_line)
+	return 0;
+    }
+  return 1;
+}
+
+// cells around box expanded by r
+static void
+ag_box (double *box, double r, int *c)
+{
+  c[0] = ag_cx (box[0] - r);
+  c[1] = ag_cy (box[1] - r);
+  c[2] = ag_cx (box[2] + r);
+  c[3] = ag_cy (box[3] + r);
+}
+
+/*
+  arc is not closer to other points than points s..e (same rule as
+  check_line() in optimizer). Old distance is searched in growing box.
+*/
+static int
+arc_lines (int pl, int s, int e, double cx, double cy, int dir, double tol)
+{
+  double box[4], r = ag.cell, dist, old_min = DBL_MAX;
+  int c[4], x, y, k, i, j;
+
+  run_box (s, e, box);
+  for (;;)
+    {
+      ag_box (box, r, c);
+      for (y = c[1]; y <= c[3]; y++)
+	for (x = c[0]; x <= c[2]; x++)
+	  for (k = ag.start[x + y * ag.nx]; k < ag.start[x + y * ag.nx + 1];
+	       k++)
+	    {
+	      i = ag.item[k];
+	      if (ag.pl[i] == pl && ag.idx[i] >= s && ag.idx[i] <= e)
+		continue;
+	      for (j = s; j < e; j++)
+		{
+		  dist = lineSegmentToPointDistance2D
+		    (run.x[j], run.y[j], run.x[j + 1], run.y[j + 1],
+		     ag.x[i], ag.y[i]);
+		  if (dist < old_min)
+		    old_min = dist;
+		}
+	    }
+      if (old_min <= r)
+	break;
+      if (c[0] == 0 && c[1] == 0 && c[2] == ag.nx - 1 && c[3] == ag.ny - 1)
+	break;
+      r *= 2;
+    }
+  if (old_min == DBL_MAX)
+    return 1;
+
+  // arc is in tolerance from points
+  ag_box (box, old_min + tol, c);
+  for (y = c[1]; y <= c[3]; y++)
+    for (x = c[0]; x <= c[2]; x++)
+      for (k = ag.start[x + y * ag.nx]; k < ag.start[x + y * ag.nx + 1]; k++)
+	{
+	  i = ag.item[k];
+	  if (ag.pl[i] == pl && ag.idx[i] >= s && ag.idx[i] <= e)
+	    continue;
+	  if (arcToPointDistance2D (run.x[s], run.y[s], run.x[e], run.y[e],
+				    cx - run.x[s], cy - run.y[s], dir > 0,
+				    ag.x[i], ag.y[i]) < old_min)
+	    return 0;
+	}
+  return 1;
+}
+
+// replace runs of points in polyline number pl by arcs, return number of arcs
+static int
+arc_polyline (struct image *image, struct polyline *ps, int pl, int *removed)
+{
+  struct polyline_point *p, *p_next;
+  double tol = image->arc_tolerance, cx, cy, bx = 0, by = 0;
+  int s, e, best, dir, bdir = 0, arcs = 0;
+
+  for (run.n = 0, p = ps->points; p != NULL; p = p->next, run.n++)
+    {
+      if (run.n == run.size)
+	{
+	  run.size = run.size ? run.size * 2 : 1024;
+	  run.p = realloc (run.p, run.size * sizeof (struct polyline_point *));
+	  run.x = realloc (run.x, run.size * sizeof (double));
+	  run.y = realloc (run.y, run.size * sizeof (double));
+	}
+      run.p[run.n] = p;
+      run.x[run.n] = i2realX (image, p->x) / 2.0;
+      run.y[run.n] = i2realY (image, p->y) / 2.0;
+    }
+
+  for (s = 0; s + ARC_MIN_POINTS - 1 < run.n;)
+    {
+      // longest arc, then shorter arcs until clearance test pass
+      for (best = -1, e = s + ARC_MIN_POINTS - 1;
+	   e < run.n && e - s < ARC_MAX_POINTS; e++)
+	{
+	  if (!arc_shape (tol, s, e, &cx, &cy, &dir))
+	    break;
+	  best = e;
+	}
+      for (; best >= s + ARC_MIN_POINTS - 1; best--)
+	if (arc_shape (tol, s, best, &bx, &by, &bdir)
+	    && arc_copper (image, s, best, bx, by, bdir)
+	    && arc_holes (image, s, best, bx, by, bdir, tol)
+	    && arc_lines (pl, s, best, bx, by, bdir, tol))
+	  break;
+      if (best < s + ARC_MIN_POINTS - 1)
+	{
+	  s++;
+	  continue;
+	}
+      p = run.p[s];
+      p->arc = bdir;
+      p->arc_cx = bx;
+      p->arc_cy = by;
+      for (p = p->next; p != run.p[best]; p = p_next)
+	{
+	  p_next = p->next;
+	  arena_free (image, ARENA_POINT, p);
+	  (*removed)++;
+	}
+      run.p[s]->next = run.p[best];
+      arcs++;
+      s = best;
+    }
+  return arcs;
+}
+
+void
+arc_fit (struct image *image)
+{
+  struct polyline *ps;
+  int k, arcs = 0, removed = 0;
+
+  if (image->arc_tolerance <= 0)
+    return;
+  printf ("ARC fitting, tolerance %f\n", image->arc_tolerance);
+  ag_build (image);
+  for (k = 0, ps = image->first_polyline; ps != NULL; ps = ps->next, k++)
+    arcs += arc_polyline (image, ps, k, &removed);
+  ag_free ();
+  printf ("ARC %d arcs, %d points removed\n", arcs, removed);
+}
@@ -0,0 +1,128 @@
+/*
+    arena.c
+
+    This is part of pcb2g - pcb bitmap to G code converter
+
+    Copyright (C) 2011- 2015 Peter Popovec, popovec@fei.tuke.sk
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    small object allocator (polyline points, polylines, polyline trees,
+    m_points)
+
+    Objects are allocated from big blocks (bump allocation), each object
+    type has own free list. All blocks are owned by image and released
+    at once by arena_release(). arena_alloc() and arena_free() are
+    locked (polyline trees are created in threads), arena must be created
+    before threads are started.
+
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pcb2g.h"
+
+#define ARENA_BLOCK (64 * 1024)
+
+struct arena_block
+{
+  struct arena_block *next;
+};
+
+struct arena_pool
+{
+  size_t size;
+  void *free;			// free list
+  char *cur;			// bump pointer in current block
+  size_t left;
+};
+
+struct arena
+{
+  struct arena_pool pool[ARENA_TYPES];
+  struct arena_block *blocks;
+  pthread_mutex_t lock;
+};
+
+// allocate zeroed object of given type
+void *
+arena_alloc (struct image *image, int type, size_t size)
+{
+  struct arena *a = image->arena;
+  struct arena_pool *pool;
+  struct arena_block *b;
+  void *p;
+
+  if (!a)
+    {
+      a = image->arena = calloc (1, sizeof (struct arena));
+      pthread_mutex_init (&a->lock, NULL);
+    }
+  pthread_mutex_lock (&a->lock);
+  pool = &a->pool[type];
+  if (!pool->size)		// round up to pointer size
+    pool->size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+
+  if (pool->free)
+    {
+      p = pool->free;
+      pool->free = *(void **) p;
+      pthread_mutex_unlock (&a->lock);
+      memset (p, 0, pool->size);
+      return p;
+    }
+  if (pool->left < pool->size)
+    {
+      b = malloc (sizeof (struct arena_block) + ARENA_BLOCK);
+      b->next = a->blocks;
+      a->blocks = b;
+      pool->cur = (char *) (b + 1);
+      pool->left = ARENA_BLOCK;
+    }
+  p = pool->cur;
+  pool->cur += pool->size;
+  pool->left -= pool->size;
+  pthread_mutex_unlock (&a->lock);
+  memset (p, 0, pool->size);
+  return p;
+}
+
+// return object to free list of this type
+void
+arena_free (struct image *image, int type, void *p)
+{
+  struct arena_pool *pool = &image->arena->pool[type];
+
+  pthread_mutex_lock (&image->arena->lock);
+  *(void **) p = pool->free;
+  pool->free = p;
+  pthread_mutex_unlock (&image->arena->lock);
+}
+
+void
+arena_release (struct image *image)
+{
+  struct arena_block *b;
+
+  if (!image->arena)
+    return;
+  while ((b = image->arena->blocks))
+    {
+      image->arena->blocks = b->next;
+      free (b);
+    }
+  pthread_mutex_destroy (&image->arena->lock);
+  free (image->arena);
+  image->arena = NULL;
+}
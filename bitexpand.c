@@ -0,0 +1,367 @@
+/*
+    bitexpand.c
+
+    This is part of pcb2g - pcb bitmap to G code converter
+
+    Copyright (C) 2011- 2015 Peter Popovec, popovec@fei.tuke.sk
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    PCB copper expansion, bit packed version of bit_e()
+
+    Copper is stored as one bit per pixel in 64 bit words, pixel index is
+    same as in image->data (image is handled as one long line, exactly as
+    in byte version). Neighbour masks are not stored, mask bits for 64
+    pixels are loaded by shifting copper plane and patterns are matched
+    by boolean algebra. Output (or_mask) is identical to byte
+    version in expand.c.
+
+    mask bits (same as get_mask()):
+    321
+    4 0
+    567
+
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pcb2g.h"
+
+struct bplane
+{
+  uint64_t *mem;
+  uint64_t *w;			// word with pixel 0
+  uint64_t *tmp;		// new pixels in parallel pass
+  uint64_t *tmp_mem;
+  int words;			// words for x*y pixels
+  int pad;			// guard words before and after image
+  long off[8];			// pixel offset for mask bits
+  long size;			// image->size
+  long x;
+};
+
+//mask patterns, from expand_rule[] and expand_noexpand[] tables
+struct bpat
+{
+  unsigned char p[256];
+  int n;
+};
+
+static struct bpat p_4to8, p_diag, p_diag_fill, p_up, p_down, p_left,
+  p_right, p_rozok, p_noexpand;
+
+static void
+b_patterns (struct bpat *pat, const unsigned char *table, unsigned char rule)
+{
+  int m;
+
+  for (pat->n = 0, m = 0; m < 256; m++)
+    if (table[m] & rule)
+      pat->p[pat->n++] = m;
+}
+
+static void
+b_patterns_init (void)
+{
+  expand_rules_init ();
+  b_patterns (&p_4to8, expand_rule, R_4TO8);
+  b_patterns (&p_diag, expand_rule, R_DIAG);
+  b_patterns (&p_diag_fill, expand_rule, R_DIAG_FILL);
+  b_patterns (&p_up, expand_rule, R_UP);
+  b_patterns (&p_down, expand_rule, R_DOWN);
+  b_patterns (&p_left, expand_rule, R_LEFT);
+  b_patterns (&p_right, expand_rule, R_RIGHT);
+  b_patterns (&p_rozok, expand_rule, R_ROZOK);
+  b_patterns (&p_noexpand, expand_noexpand, 0xff);
+}
+
+static inline int
+b_get (struct bplane *b, long p)
+{
+  return (b->w[p >> 6] >> (p & 63)) & 1;
+}
+
+static inline void
+b_set (struct bplane *b, long p)
+{
+  b->w[p >> 6] |= 1ULL << (p & 63);
+}
+
+// 64 pixels starting at pixel p (p can be negative up to guard size)
+static inline uint64_t
+b_get64 (uint64_t * w, long p)
+{
+  long q = p >> 6;
+  int r = p & 63;
+
+  if (!r)
+    return w[q];
+  return (w[q] >> r) | (w[q + 1] << (64 - r));
+}
+
+// mask for mask index i (pixel i + x + 1), exactly as get_mask()
+static unsigned char
+b_mask (struct bplane *b, long i)
+{
+  unsigned char mask = 0;
+  long p = i + b->x + 1;
+  int k;
+
+  for (k = 0; k < 8; k++)
+    if (b_get (b, p + b->off[k]))
+      mask |= 1 << k;
+  return mask;
+}
+
+/* match all patterns for 64 pixels starting at pixel p (p % 64 == 0),
+   return bit for each pixel with mask in pattern list */
+static uint64_t
+b_match (struct bplane *b, long p, const unsigned char *pat, int n)
+{
+  uint64_t nb[8], m = 0, t;
+  int k, i;
+
+  for (k = 0; k < 8; k++)
+    nb[k] = b_get64 (b->w, p + b->off[k]);
+
+  for (i = 0; i < n; i++)
+    {
+      t = ~0ULL;
+      for (k = 0; k < 8; k++)
+	t &= nb[k] ^ ((uint64_t) ((pat[i] >> k) & 1) - 1);
+      m |= t;
+    }
+  return m;
+}
+
+// bits from pixel "from" to pixel "to" (inclusive) in word starting at pixel p
+static inline uint64_t
+b_range (long p, long from, long to)
+{
+  uint64_t r = ~0ULL;
+
+  if (from > p)
+    r &= ~0ULL << (from - p);
+  if (to < p + 63)
+    r &= ~0ULL >> (p + 63 - to);
+  return r;
+}
+
+/* parallel pass, all pixels are tested against state before pass (same
+   as l_* function matching masks before pass and writing or_mask) */
+static int
+b_pass (struct bplane *b, const unsigned char *pat, int n)
+{
+  long p, from, to;
+  int q, count = 0;
+  uint64_t m;
+
+  //mask index from x+1 to size-1
+  from = b->x + 1 + b->x + 1;
+  to = b->size - 1 + b->x + 1;
+
+  for (q = from >> 6; q <= (to >> 6); q++)
+    {
+      p = (long) q << 6;
+      m = ~b->w[q] & b_range (p, from, to);
+      if (m)
+	m &= b_match (b, p, pat, n);
+      b->tmp[q] = m;
+      count += __builtin_popcountll (m);
+    }
+  for (q = from >> 6; q <= (to >> 6); q++)
+    b->w[q] |= b->tmp[q];
+  return count;
+}
+
+/* search next mask index (from i) that match noexpand patterns in actual
+   copper plane, return -1 if nothing found */
+static long
+b_next (struct bplane *b, long i)
+{
+  long p, from, to;
+  int q;
+  uint64_t m;
+
+  from = i + b->x + 1;
+  to = b->size - 1 + b->x + 1;
+
+  for (q = from >> 6; q <= (to >> 6); q++)
+    {
+      p = (long) q << 6;
+      m = ~b->w[q] & b_range (p, from, to);
+      if (m)
+	m &= b_match (b, p, p_noexpand.p, p_noexpand.n);
+      if (m)
+	return p + __builtin_ctzll (m) - b->x - 1;
+    }
+  return -1;
+}
+
+/* l_noexpand() reads and writes or_mask in place and its result depends
+   on scan order (including jumps back/forward), scan is emulated
+   exactly, but runs of pixels without match are skipped by 64 */
+static int
+b_noexpand (struct bplane *b)
+{
+  long i, j;
+  int count = 0;
+
+  for (i = b->x + 1; i < b->size;)
+    {
+      j = b_next (b, i);
+      if (j < 0)
+	break;
+      count++;
+      switch (expand_noexpand[b_mask (b, j)])
+	{
+	case NE_UP:
+	  i = (j - b->x > 0) ? j - b->x : j + 1;
+	  break;
+	case NE_DOWN:
+	  i = (j + b->x < b->size) ? j + b->x : j + 1;
+	  break;
+	case NE_LEFT:
+	  i = j - 1;
+	  break;
+	case NE_NEXT:
+	  i = j + 1;
+	  break;
+	default:
+	  i = j + 2;
+	}
+      b_set (b, j + b->x + 1);
+    }
+  return count;
+}
+
+// copper added by expansion (not in original image)
+static inline int
+b_added (struct image *image, struct bplane *b, long p)
+{
+  if (p < 0 || p >= (long) image->x * image->y)
+    return 0;
+  return b_get (b, p) && image->data[p] > 70;
+}
+
+// create or_mask exactly as byte version does
+static void
+b_unpack (struct image *image, struct bplane *b)
+{
+  long i, p, all;
+  int k;
+  unsigned char mask;
+
+  all = (long) image->x * (image->y + 2);
+  image->or_mask = calloc (all, sizeof (unsigned char));
+
+  for (i = 0; i < b->size; i++)
+    image->or_mask[i] = b_mask (b, i);
+
+  // behind size, or_mask is set only by SET_OR_MASK
+  for (; i < all; i++)
+    {
+      p = i + b->x + 1;
+      for (mask = 0, k = 0; k < 8; k++)
+	if (b_added (image, b, p + b->off[k]))
+	  mask |= 1 << k;
+      image->or_mask[i] = mask;
+    }
+}
+
+void
+bit_e64 (struct image *image)
+{
+  struct bplane b;
+  int flag = 0;
+  int j, ret, allret;
+  long i;
+  struct timespec ts, ts_old, ts_diff;
+
+  b_patterns_init ();
+  image->size = image->x * (image->y - 2) - 2;
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts_old);
+
+  b.x = image->x;
+  b.size = image->size;
+  b.words = ((long) image->x * image->y + 63) / 64;
+  b.pad = (image->x + 1) / 64 + 2;
+  b.mem = calloc (b.words + 2 * b.pad, sizeof (uint64_t));
+  b.tmp_mem = calloc (b.words + 2 * b.pad, sizeof (uint64_t));
+  b.w = b.mem + b.pad;
+  b.tmp = b.tmp_mem + b.pad;
+
+  b.off[0] = 1;
+  b.off[1] = -b.x + 1;
+  b.off[2] = -b.x;
+  b.off[3] = -b.x - 1;
+  b.off[4] = -1;
+  b.off[5] = b.x - 1;
+  b.off[6] = b.x;
+  b.off[7] = b.x + 1;
+
+  for (i = 0; i < (long) image->x * image->y; i++)
+    if (image->data[i] <= 70)
+      b_set (&b, i);
+
+  printf ("4to8 %d\n", b_pass (&b, p_4to8.p, p_4to8.n));
+
+  for (j = 0;; j++)
+    {
+      allret = 0;
+
+      do
+	{
+	  ret = b_noexpand (&b);
+	  allret += ret;
+	}
+      while (ret);
+
+      if (!flag)
+	{
+	  printf ("diag %d\n", b_pass (&b, p_diag.p, p_diag.n));
+	  flag++;
+	  printf ("diag_fill %d\n",
+		  b_pass (&b, p_diag_fill.p, p_diag_fill.n));
+	}
+
+      ret = b_pass (&b, p_up.p, p_up.n);
+      ret += b_pass (&b, p_down.p, p_down.n);
+      ret += b_pass (&b, p_left.p, p_left.n);
+      ret += b_pass (&b, p_right.p, p_right.n);
+      ret += b_pass (&b, p_rozok.p, p_rozok.n);
+
+      allret += ret;
+      if (!allret)
+	break;
+
+      clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+      ts_diff = tsx_diff (ts_old, ts);
+      printf ("................... iteration %d, time %ld.%09ld", j,
+	      ts_diff.tv_sec, ts_diff.tv_nsec);
+      ts_diff = tsx_diff (image->ts, ts);
+      printf (" sum: %ld.%09ld\n", ts_diff.tv_sec, ts_diff.tv_nsec);
+
+      ts_old.tv_sec = ts.tv_sec;
+      ts_old.tv_nsec = ts.tv_nsec;
+    }
+
+  b_unpack (image, &b);
+  free (b.mem);
+  free (b.tmp_mem);
+  printf ("all ok\n");
+}
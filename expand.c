@@ -25,133 +25,357 @@
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "pcb2g.h"
 
-//#define SPEED_UP1
+/*
+  Expansion rules are compiled into 256 entry tables indexed by mask
+  (bits 321/4 0/567 as in get_mask()), one table lookup replaces switch
+  statement for each rule.
+*/
+unsigned char expand_rule[256];
+unsigned char expand_noexpand[256];
+static unsigned char local_rule[256];
+
+#define L_END 1
+#define L_T1  2
+
+// o ->x if match mask
+static const unsigned char p_local_end[] = {
+  0xa7,				// a7
+  0xcb,				// .xx x.x xx. x.x x.. xxx xxx ..x
+  0xbc,				// .ox .ox xo. xo. .ox .ox xo. xo.
+  0x7a,				// x.x .xx x.x xx. xxx x.. ..x xxx
+  0xe9,
+  0x2f,
+  0x9e,
+  0xf2,
+
+  0xbe,				//  be  fa  af  eb
+  0xfa,				// xxx x.x xxx x.x
+  0xaf,				// xo. xo. .ox .ox
+  0xeb,				// x.x xxx x.x xxx
+
+  0xe0,				//  e0  0e  83  38
+  0x0e,				// ... xxx ..x x..
+  0x83,				// .o. .o. .ox xo.
+  0x38,				// xxx ... ..x x..
+
+  0x06,				//  06  0c  30  18  c0  60  81  03
+  0x0c,				// .xx xx. ... x.. ... ... ... ..x
+  0x30,				// .o. .o. xo. xo. .o. .o. .ox .ox
+  0x18,				// ... ... x.. ... .xx xx. ..x ...
+  0xc0,
+  0x60,
+  0x81,
+  0x03,
+};
+
+// o ->x if match mask x = copper
+static const unsigned char p_local_T1[] = {
+  0x2b,				//  2b  a9  a6  ac  9a  b2  6a  ca
+  0xa9,				// x.x x.. .xx xx. x.x ..x x.x x.x
+  0xa6,				// .ox .ox .o. .o. xo. xo. .o. .o.
+  0xac,				// x.. x.x x.x x.x ..x x.x xx. .xx
+  0x9a,
+  0xb2,
+  0x6a,
+  0xca,
+
+  0xae,				//  ae  ea  ab  ba
+  0xea,				// xxx x.x x.x x.x
+  0xab,				// .o. .o. .ox xo.
+  0xba,				// x.x xxx x.x x.x
+};
+
+//convert 4 to 8 continuous
+/*   34  85  58  43  16  0D  D0 16
+321  .x. .x. x.. ..x .xx xx.
+4 0  x.. ..x x.. ..x x.. ..x
+567  x.. ..x .x. .x. ... ...
+*/
+static const unsigned char p_4to8[] =
+  { 0x34, 0x85, 0x58, 0x43, 0x16, 0x0d, 0x61, 0xd0 };
+
+//convert diagonal
+/*   14  05  50  41
+321  .x. .x. ... ...
+4 0  x.. ..x x.. ..x
+567  ... ... .x. .x.
+*/
+static const unsigned char p_diag[] = { 0x14, 0x05, 0x50, 0x41 };
+
+//diag_fill
+/*   97   D3   3D   79   5e  4f  f4  e5
+321  .xx  ..x  xx.  x..  xxx xxx .x. .x.
+4 0  x.x  x.x  x.x  x.x  x.. ..x x.. ..x
+567  ..x  .xx  x..  xx.  .x. .x. xxx xxx
+*/
+static const unsigned char p_diag_fill[] =
+  { 0x97, 0xd3, 0x3d, 0x79, 0x5e, 0xe5, 0x4f, 0xf4 };
+
+/*   e0   e1  f0
+321  ...  ... ...
+4 0  ...  ..x x..
+567  xxx  xxx xxx
+
+x = copper
+*/
+static const unsigned char p_up[] = { 0xe0, 0xe1, 0xf0 };
+
+/*   0e   1e  0f
+321  XXX  xxx xxx
+4 0  ...  x.. ..x
+567  ...  ... ...
+*/
+static const unsigned char p_down[] = { 0x0e, 0x1e, 0x0f };
+
+/*   83   87  c3
+321  ..x .xx ..x
+4 0  ..x ..x ..x
+567  ..x ..x .xx
+*/
+static const unsigned char p_left[] = { 0x83, 0x87, 0xc3 };
+
+/*   38  3c  78
+321  x.. xx. x..
+4 0  x.. x.. x..
+567  x.. x.. xx.
+*/
+static const unsigned char p_right[] = { 0x38, 0x3c, 0x78 };
+
+/*   1c  70  07  c1
+321  xx. ... .xx ...
+4 0  x.. x.. ..x ..x
+567  ... xx. ... .xx
+*/
+
+/*    3e  8f  f8  e3
+321  XXX xxx x.. ..x
+4 0  X.. ..x x.. ..x
+567  X.. ..x xxx xxx
+*/
+static const unsigned char p_rozok[] =
+  { 0x1c, 0x70, 0x07, 0xc1, 0x3e, 0x8f, 0xf8, 0xe3 };
+
+/* noexpand rules */
+
+  //x.x
+  //x.x
+  //xxx
+static const unsigned char p_ne_up[] = { 0xfb };
+
+  //xxx
+  //x.x
+  //x.x
+static const unsigned char p_ne_down[] = { 0xbf };
+
+  //xxx
+  //..x
+  //xxx
+static const unsigned char p_ne_left[] = { 0xef };
+
+/*   f1  f9  f3  1f  3f  9f  c7  cf  e7  fd  f7  df  7f
+321  ... x.. ..x xxx xxx xxx .xx XXX .XX xx. .xx xxx xxx
+4 0  x.x x.x x.x x.x x.x x.x ..x ..X ..X x.x x.x x.x x.x
+567  xxx xxx xxx ... x.. ..x .xx .XX XXX xxx xxx .xx xx.
+*/
+static const unsigned char p_ne_skip[] = {
+  0xf1, 0xf9, 0xf3, 0x1f, 0x3f, 0x9f, 0xc7, 0xcf, 0xe7, 0xfd, 0xf7, 0xdf,
+  0x7f
+};
+
+/*   7c  fe  7e  fc
+321  xx. xxx XXX xx.
+4 0  x.. x.. x.. x..
+567  xx. xxx XX. xxx
+*/
+static const unsigned char p_ne_next[] = { 0x7c, 0xfe, 0x7e, 0xfc };
+
+#define NPAT(p) (sizeof (p) / sizeof (p[0]))
+
+static void
+rule_add (unsigned char *table, const unsigned char *pat, int n,
+	  unsigned char value)
+{
+  int i;
 
-static unsigned char
-get_mask (struct image *image, int i, int border)
+  for (i = 0; i < n; i++)
+    table[pat[i]] |= value;
+}
+
+void
+expand_rules_init (void)
 {
-  unsigned char mask = 0;
-
-  if (*(image->data + i) <= border)
-    mask |= 1 << 3;
-  if (*(image->data + i + 1) <= border)
-    mask |= 1 << 2;
-  if (*(image->data + i + 2) <= border)
-    mask |= 1 << 1;
-  if (*(image->data + i + 2 + image->x) <= border)
-    mask |= 1 << 0;
-  if (*(image->data + i + image->x) <= border)
-    mask |= 1 << 4;
-  if (*(image->data + i + image->x + image->x) <= border)
-    mask |= 1 << 5;
-  if (*(image->data + i + 1 + image->x + image->x) <= border)
-    mask |= 1 << 6;
-  if (*(image->data + i + 2 + image->x + image->x) <= border)
-    mask |= 1 << 7;
-  return mask;
+  static int done;
 
+  if (done)
+    return;
+  done = 1;
+
+  rule_add (expand_rule, p_4to8, NPAT (p_4to8), R_4TO8);
+  rule_add (expand_rule, p_diag, NPAT (p_diag), R_DIAG);
+  rule_add (expand_rule, p_diag_fill, NPAT (p_diag_fill), R_DIAG_FILL);
+  rule_add (expand_rule, p_up, NPAT (p_up), R_UP);
+  rule_add (expand_rule, p_down, NPAT (p_down), R_DOWN);
+  rule_add (expand_rule, p_left, NPAT (p_left), R_LEFT);
+  rule_add (expand_rule, p_right, NPAT (p_right), R_RIGHT);
+  rule_add (expand_rule, p_rozok, NPAT (p_rozok), R_ROZOK);
+
+  rule_add (expand_noexpand, p_ne_up, NPAT (p_ne_up), NE_UP);
+  rule_add (expand_noexpand, p_ne_down, NPAT (p_ne_down), NE_DOWN);
+  rule_add (expand_noexpand, p_ne_left, NPAT (p_ne_left), NE_LEFT);
+  rule_add (expand_noexpand, p_ne_skip, NPAT (p_ne_skip), NE_SKIP);
+  rule_add (expand_noexpand, p_ne_next, NPAT (p_ne_next), NE_NEXT);
+
+  rule_add (local_rule, p_local_end, NPAT (p_local_end), L_END);
+  rule_add (local_rule, p_local_T1, NPAT (p_local_T1), L_T1);
 }
 
+/*
+  Frontier: only masks changed since last full evaluation can match a
+  rule again. Each row of masks (row = mask index / x) is split into
+  words of 64 masks, word_stamp[word] holds stamp of last change in word,
+  stamp is incremented at start of each pass. Words do not cross end of
+  row (threads in row bands never share a word).
+*/
+#define F_SHIFT 6
+static int *word_stamp;
+static int row_words;
+static int stamp;
+
+// bytes of mask planes copied/cleared by expansion (iteration report)
+static long moved;
+// match plane and row flags for multithreaded passes, kept for all
+// passes in bit_e(), only rows with some match are cleared
+static unsigned char *match_mem;
+static unsigned char *row_match;
 
+static void
+frontier_init (struct image *image)
+{
+  row_words = (image->x + (1 << F_SHIFT) - 1) >> F_SHIFT;
+  if (!word_stamp)
+    word_stamp = calloc ((image->y + 2) * row_words, sizeof (int));
+  else
+    memset (word_stamp, 0, (image->y + 2) * row_words * sizeof (int));
+  stamp = 1;
+}
+
+// word of mask i, *end = first mask after this word (if end != NULL)
 static int
-local_end (struct image *image, int fill_data, int border)
+frontier_word (struct image *image, int i, int *end)
 {
-  int count = 0;
-  int i;
+  int r = i / image->x;
+  int w = (i - r * image->x) >> F_SHIFT;
+
+  if (end)
+    {
+      *end = r * image->x + ((w + 1) << F_SHIFT);
+      if (*end > (r + 1) * image->x)
+	*end = (r + 1) * image->x;
+    }
+  return r * row_words + w;
+}
+
+/*
+  first mask in i .. to - 1 in word changed since stamp "clean" (or to),
+  *end = end of this word (max to)
+*/
+static int
+frontier_next (struct image *image, int i, int to, int clean, int *end)
+{
+  int w;
+
+  for (; i < to; i = *end)
+    {
+      w = frontier_word (image, i, end);
+      if (*end > to)
+	*end = to;
+      if (word_stamp[w] >= clean)
+	return i;
+    }
+  *end = to;
+  return to;
+}
 
-  unsigned char mask;
+// masks i - x - 1 .. i - x + 1, i - 1 .. i + 1, i + x - 1 .. i + x + 1
+// are changed
+static void
+frontier_mark (struct image *image, int i)
+{
+  int k, a;
 
-  for (i = 0; i < image->size; i++)
+  for (k = -1; k <= 1; k++)
     {
-      if (*(image->data + i + 1 + image->x) <= border)
+      a = i + k * image->x;
+      if (a + 1 < 0)
 	continue;
+      word_stamp[frontier_word (image, a + 1, NULL)] = stamp;
+      if (a - 1 >= 0)
+	word_stamp[frontier_word (image, a - 1, NULL)] = stamp;
+    }
+}
 
-      mask = get_mask (image, i, border);
-      switch (mask)		// o ->x if match mask
-	{
-	case 0xa7:		// a7
-	case 0xcb:		// .xx x.x xx. x.x x.. xxx xxx ..x
-	case 0xbc:		// .ox .ox xo. xo. .ox .ox xo. xo.
-	case 0x7a:		// x.x .xx x.x xx. xxx x.. ..x xxx
-	case 0xe9:
-	case 0x2f:
-	case 0x9e:
-	case 0xf2:
-
-	case 0xbe:		//  be  fa  af  eb
-	case 0xfa:		// xxx x.x xxx x.x
-	case 0xaf:		// xo. xo. .ox .ox
-	case 0xeb:		// x.x xxx x.x xxx
-
-	case 0xe0:		//  e0  0e  83  38
-	case 0x0e:		// ... xxx ..x x..
-	case 0x83:		// .o. .o. .ox xo.
-	case 0x38:		// xxx ... ..x x..
-
-	case 0x06:		//  06  0c  30  18  c0  60  81  03
-	case 0x0c:		// .xx xx. ... x.. ... ... ... ..x
-	case 0x30:		// .o. .o. xo. xo. .o. .o. .ox .ox
-	case 0x18:		// ... ... x.. ... .xx xx. ..x ...
-	case 0xc0:
-	case 0x60:
-	case 0x81:
-	case 0x03:
-
-
-	  *(image->data + i + 1 + image->x) = fill_data;
-	  count++;
-	}
-#ifdef SPEED_UP1
-      i += (mask & 1);
-#endif
+// number of masks in words changed since stamp "clean"
+static int
+frontier_size (struct image *image, int clean)
+{
+  int i, end, count = 0;
+
+  for (i = 0; i < image->size; i = end)
+    {
+      i = frontier_next (image, i, image->size, clean, &end);
+      count += end - i;
     }
-  //printf ("end filter %d\n", count);
   return count;
 }
 
+// words not changed since stamp "clean" are skipped
 static int
-local_T1 (struct image *image, int fill_data, int border)
+local_rules (struct image *image, unsigned char *masks, unsigned char rule,
+	     int fill_data, int border, int clean)
 {
   int count = 0;
-  int i;
-
-  unsigned char mask;
+  int i, end;
 
-  for (i = 0; i < image->size; i++)
+  stamp++;
+  for (i = 0; i < image->size;)
     {
-      if (*(image->data + i + 1 + image->x) <= border)
-	continue;
-      mask = get_mask (image, i, border);
-      switch (mask)		// o ->x if match mask x = copper
+      for (i = frontier_next (image, i, image->size, clean, &end); i < end;
+	   i++)
 	{
-
-	case 0x2b:		//  2b  a9  a6  ac  9a  b2  6a  ca
-	case 0xa9:		// x.x x.. .xx xx. x.x ..x x.x x.x 
-	case 0xa6:		// .ox .ox .o. .o. xo. xo. .o. .o.
-	case 0xac:		// x.. x.x x.x x.x ..x x.x xx. .xx
-	case 0x9a:
-	case 0xb2:
-	case 0x6a:
-	case 0xca:
-
-	case 0xae:		//  ae  ea  ab  ba
-	case 0xea:		// xxx x.x x.x x.x
-	case 0xab:		// .o. .o. .ox xo.
-	case 0xba:		// x.x xxx x.x x.x
-
-	  *(image->data + i + 1 + image->x) = fill_data;
-	  count++;
+	  if (*(image->data + i + 1 + image->x) <= border)
+	    continue;
+
+	  if (local_rule[masks[i]] & rule)
+	    {
+	      *(image->data + i + 1 + image->x) = fill_data;
+	      mask_update (image, masks, i + 1 + image->x,
+			   fill_data <= border);
+	      frontier_mark (image, i);
+	      count++;
+	    }
 	}
-#ifdef SPEED_UP1
-      i += (mask & 1);
-#endif
     }
-  //printf ("end filter T1 %d\n", count);
   return count;
 }
 
+static int
+local_end (struct image *image, unsigned char *masks, int fill_data,
+	   int border, int clean)
+{
+  //printf ("end filter %d\n", count);
+  return local_rules (image, masks, L_END, fill_data, border, clean);
+}
+
+static int
+local_T1 (struct image *image, unsigned char *masks, int fill_data,
+	  int border, int clean)
+{
+  //printf ("end filter T1 %d\n", count);
+  return local_rules (image, masks, L_T1, fill_data, border, clean);
+}
 
 void
 recolor (struct image *image, int fill_color, int level)
@@ -163,50 +387,101 @@ recolor (struct image *image, int fill_color, int level)
   return;
 }
 
+/*
+  palette for recolor_map(), recolor_map_add() calls are composed in same
+  way as sequence of recolor() calls
+*/
+void
+recolor_map_init (unsigned char *map)
+{
+  int i;
+  for (i = 0; i < 256; i++)
+    map[i] = i;
+}
+
+void
+recolor_map_add (unsigned char *map, int fill_color, int level)
+{
+  int i;
+  for (i = 0; i < 256; i++)
+    if (map[i] == level)
+      map[i] = fill_color;
+}
+
+// remap whole image in one pass
+void
+recolor_map (struct image *image, unsigned char *map)
+{
+  unsigned char *d = image->data;
+  unsigned char *end = d + image->x * image->y;
+
+  for (; d < end; d++)
+    *d = map[*d];
+}
+
 static void bit_e (struct image *image);
+static void debug_dump_bit_image (struct image *image);
 
 int
 expand_copper (struct image *image)
 {
 
   int ret, i1, i2, flag;
+  int clean_t1 = 0, clean_end = 0;
+  unsigned char map[256];
 
-  bit_e (image);
+  if (image->expand_engine == 1)
+    bit_e64 (image);
+  else
+    bit_e (image);
+  if (image->debug_files)
+    debug_dump_bit_image (image);
 
   for (i1 = 0, i2 = image->x; i1 < image->size; i1++, i2++)
-    if (image->mask_data[i1] & 0x10)
+    if (image->or_mask[i1] & 0x10)
       if (image->data[i2] != 0)
 	image->data[i2] = 1;
 
   //printf ("all ok\n");
 
+  //or_mask is not needed anymore, use it for local_T1/local_end masks
+  mask_plane (image, image->or_mask, 90);
+  frontier_init (image);
   for (flag = 1; flag;)
     {
       flag = 0;
       for (;;)
 	{
-	  ret = local_T1 (image, 70, 90);
+	  ret = local_T1 (image, image->or_mask, 70, 90, clean_t1);
 	  if (!ret)
 	    break;
 	  flag = 1;
 	  printf ("local_t1 found\n");
 	}
+      clean_t1 = stamp;
       for (;;)
 	{
-	  ret = local_end (image, 70, 90);
+	  ret = local_end (image, image->or_mask, 70, 90, clean_end);
 	  if (!ret)
 	    break;
 	  flag = 1;
 	  printf ("local_end found\n");
 	}
+      clean_end = stamp;
     }
-  recolor (image, 160, 70);
-
-  recolor (image, 150, C_HOLE);
-  recolor (image, 190, C_HOLE_ALIGNED);
-  recolor (image, 200, 1);
-  recolor (image, 255, 0);
-  recolor (image, 0, 100);
+  free (word_stamp);
+  word_stamp = NULL;
+  free (image->or_mask);
+  image->or_mask = NULL;
+  recolor_map_init (map);
+  recolor_map_add (map, 160, 70);
+
+  recolor_map_add (map, 150, C_HOLE);
+  recolor_map_add (map, 190, C_HOLE_ALIGNED);
+  recolor_map_add (map, 200, 1);
+  recolor_map_add (map, 255, 0);
+  recolor_map_add (map, 0, 100);
+  recolor_map (image, map);
 /*
   for (sy = 0, sx = 0; sx < image->x * image->y; sx++)
     if (*(image->data + sx) < 64)
@@ -225,137 +500,367 @@ expand_copper (struct image *image)
 	  image->or_mask[i + 1 - image->x] |= 0x20; \
 	  image->or_mask[i - 1 + image->x] |= 0x02; \
 	  image->or_mask[i + image->x] |= 0x04; \
-	  image->or_mask[i + 1 + image->x] |= 0x08;
+	  image->or_mask[i + 1 + image->x] |= 0x08; \
+	  frontier_mark (image, i);
 
-//convert 4 to 8 continuous
-/*   34  85  58  43  16  0D  D0 16
-321  .x. .x. x.. ..x .xx xx.
-4 0  x.. ..x x.. ..x x.. ..x
-567  x.. ..x .x. .x. ... ...
+/*
+  Apply rules[0] .. rules[n-1] in one sweep. Result is same as for
+  separate passes (each pass matches masks of image after previous
+  pass, new pixels are written to or_mask, snapshot copy between passes
+  is not needed).
+
+  Image is processed in blocks of x+1 masks, pass k runs one block
+  behind pass k-1. At this distance pass k-1 has done all changes of
+  mask i and pass k+1 has not changed mask i yet. Only changes from
+  pass k itself (left pixel and pixels in row above) are removed from
+  mask, these bits are stored in ring buffer of x+2 masks for each pass.
+
+  Words not changed since stamp "clean" are skipped (if pass set pixel,
+  neighbour words are marked, there are no own changes in skipped word).
 */
+static void
+l_rules (struct image *image, const unsigned char *rules, int n, int *counts,
+	 int clean)
+{
+  int x = image->x;
+  int lag = x + 1;
+  int ring = x + 2;
+  int t, k, i, j, r, from, to, end, count;
+  int pos[8];
+  unsigned char m, rule, *own, *o;
+  unsigned char *or_mask = image->or_mask;
+
+  stamp++;
+  own = calloc (ring * n, sizeof (unsigned char));
+  for (k = 0; k < n; k++)
+    pos[k] = (x + 1) % ring;
+
+  for (t = x + 1; t < image->size + (n - 1) * lag; t += lag)
+    for (k = 0; k < n; k++)
+      {
+	from = t - k * lag;
+	to = from + lag;
+	if (from < x + 1)
+	  from = x + 1;
+	if (to > image->size)
+	  to = image->size;
+	if (from >= to)
+	  continue;
+	rule = rules[k];
+	o = own + k * ring;
+	r = pos[k];
+	count = 0;
+
+	for (i = from; i < to;)
+	  {
+	    j = frontier_next (image, i, to, clean, &end);
+	    r = (r + j - i) % ring;
+	    for (i = j; i < end; i++)
+	      {
+		m = o[r];
+		o[r] = 0;
+		if (++r == ring)
+		  r = 0;
+
+		if ((or_mask[i - 1] & 1))
+		  continue;
+
+		m = or_mask[i] & ~m;	// do not see own changes
+		if (expand_rule[m] & rule)
+		  {
+		    SET_OR_MASK;
+		    // r is now index i + 1
+		    o[r] |= 0x10;
+		    o[(r + x - 2) % ring] |= 0x02;
+		    o[(r + x - 1) % ring] |= 0x04;
+		    o[(r + x) % ring] |= 0x08;
+		  }
+	      }
+	  }
+	pos[k] = r;
+	counts[k] += count;
+      }
+  free (own);
+}
+
+/*
+  Multithreaded version of l_rules(), passes are not pipelined but run
+  one after another, each pass in two steps over horizontal bands:
 
+  1. match - masks are only read, match[i] = 1 for new pixels
+  2. apply - new bits are collected from match plane for each mask in
+     band (two rows halo), or_mask is written only by owner of band
+
+  Threads wait on barrier after each step, result does not depend on
+  number of threads.
+*/
+struct l_band
+{
+  struct image *image;
+  const unsigned char *rules;
+  int n, clean;
+  int r0, r1;			// rows of masks in band
+  int rows;			// all rows
+  unsigned char *match;		// match plane
+  unsigned char *row_match;	// row has some match
+  pthread_barrier_t *barrier;
+  int counts[8];
+};
 
 static int
-l_4to8 (struct image *image)
+l_band_match (struct l_band *b, unsigned char rule)
 {
-  int count = 0;
-  int i;
+  struct image *image = b->image;
+  int x = image->x;
+  int r, i, from, to, end, count = 0;
+  unsigned char any;
 
-  for (i = image->x + 1; i < image->size; i++)
+  for (r = b->r0; r < b->r1; r++)
     {
-      if ((image->mask_data[i - 1] & 1))
+      from = r * x;
+      to = from + x;
+      if (from < x + 1)
+	from = x + 1;
+      if (to > image->size)
+	to = image->size;
+      if (from >= to)
 	continue;
 
-      switch (image->mask_data[i])
+      if (b->row_match[r])
 	{
-	case 0x34:
-	case 0x85:
-	case 0x58:
-	case 0x43:
-
-	case 0x16:
-	case 0x0d:
-	case 0x61:
-	case 0xd0:
-
-	  SET_OR_MASK;
+	  memset (b->match + from, 0, to - from);
+	  __sync_fetch_and_add (&moved, to - from);
 	}
-#ifdef SPEED_UP1
-      i += (mask & 1);
-#endif
+      for (any = 0, i = from; i < to;)
+	for (i = frontier_next (image, i, to, b->clean, &end); i < end; i++)
+	  {
+	    if ((image->or_mask[i - 1] & 1))
+	      continue;
+	    if (expand_rule[image->or_mask[i]] & rule)
+	      {
+		b->match[i] = 1;
+		any = 1;
+		count++;
+	      }
+	  }
+      b->row_match[r] = any;
     }
-  printf ("4to8 %d\n", count);
   return count;
 }
 
-//convert diagonal
-/*   14  05  50  41
-321  .x. .x. ... ...
-4 0  x.. ..x x.. ..x
-567  ... ... .x. .x.
-*/
-
-
-static int
-l_diag (struct image *image)
+static void
+l_band_apply (struct l_band *b)
 {
-  int count = 0;
-  int i;
+  struct image *image = b->image;
+  unsigned char *m = b->match;
+  int x = image->x;
+  int r, k, j, any;
+  unsigned char bits;
 
-  for (i = image->x + 1; i < image->size; i++)
+  for (r = b->r0; r < b->r1; r++)
     {
-      if ((image->mask_data[i - 1] & 1))
+      for (any = 0, k = r - 2; k <= r + 2; k++)
+	if (k >= 0 && k < b->rows && b->row_match[k])
+	  any = 1;
+      if (!any)
 	continue;
 
-      switch (image->mask_data[i])
+      for (j = r * x; j < (r + 1) * x; j++)
 	{
-	case 0x14:
-	case 0x05:
-	case 0x50:
-	case 0x41:
-
-
-	  SET_OR_MASK;
+	  // same bits as SET_OR_MASK for all matched neighbours
+	  bits = 0;
+	  if (m[j - 1])
+	    bits |= 0x10;
+	  if (m[j + 1])
+	    bits |= 0x01;
+	  if (m[j + 1 + x])
+	    bits |= 0x80;
+	  if (m[j + x])
+	    bits |= 0x40;
+	  if (m[j - 1 + x])
+	    bits |= 0x20;
+	  if (m[j + 1 - x])
+	    bits |= 0x02;
+	  if (m[j - x])
+	    bits |= 0x04;
+	  if (m[j - 1 - x])
+	    bits |= 0x08;
+	  if (bits)
+	    {
+	      image->or_mask[j] |= bits;
+	      word_stamp[frontier_word (image, j, NULL)] = stamp;
+	    }
 	}
-#ifdef SPEED_UP1
-      i += (mask & 1);
-#endif
     }
-  printf ("diag %d\n", count);
-  return count;
 }
 
-//diag_fill
-/*   97   D3   3D   79   5e  4f  f4  e5
-321  .xx  ..x  xx.  x..  xxx xxx .x. .x.
-4 0  x.x  x.x  x.x  x.x  x.. ..x x.. ..x
-567  ..x  .xx  x..  xx.  .x. .x. xxx xxx
-*/
+static void *
+l_band_thread (void *arg)
+{
+  struct l_band *b = arg;
+  const unsigned char *rules = b->rules;
+  int k, n = b->n;
 
+  // b->n and b->rules may be set for next sweep after last barrier
+  for (k = 0; k < n; k++)
+    {
+      b->counts[k] = l_band_match (b, rules[k]);
+      pthread_barrier_wait (b->barrier);
+      l_band_apply (b);
+      pthread_barrier_wait (b->barrier);
+    }
+  return NULL;
+}
 
-static int
-l_diag_fill (struct image *image)
+/*
+  Band threads are created once in bit_e() and kept for all sweeps,
+  between sweeps they wait on barrier. If thread can not be created,
+  image is split into bands for threads created so far.
+*/
+static struct
 {
-  int count = 0;
-  int i;
-
-  for (i = image->x + 1; i < image->size; i++)
+  int threads;
+  int quit;
+  struct l_band *band;
+  pthread_t *tid;
+  pthread_barrier_t barrier;
+  pthread_mutex_t start;	// held until barrier is initialized
+} l_pool;
+
+static void *
+l_worker (void *arg)
+{
+  pthread_mutex_lock (&l_pool.start);
+  pthread_mutex_unlock (&l_pool.start);
+  for (;;)
     {
-      if ((image->mask_data[i - 1] & 1))
-	continue;
+      pthread_barrier_wait (&l_pool.barrier);
+      if (l_pool.quit)
+	return NULL;
+      l_band_thread (arg);
+    }
+}
 
-      switch (image->mask_data[i])
-	{
-	case 0x97:
-	case 0xd3:
-	case 0x3d:
-	case 0x79:
-	case 0x5e:
-	case 0xe5:
-	case 0x4f:
-	case 0xf4:
+static void
+l_pool_start (struct image *image)
+{
+  int x = image->x;
+  int threads = image->threads;
+  int rows, t;
+
+  // rows of masks changed by pixels in 0 .. size-1
+  rows = (image->size + x) / x + 1;
+  if (threads > rows)
+    threads = rows;
+  l_pool.threads = 1;
+  if (threads < 2)
+    return;
 
+  match_mem = calloc (x * (image->y + 2) + 2 * (x + 2), 1);
+  row_match = calloc (rows, 1);
+  l_pool.band = calloc (threads, sizeof (struct l_band));
+  l_pool.tid = calloc (threads, sizeof (pthread_t));
+  l_pool.quit = 0;
+  pthread_mutex_init (&l_pool.start, NULL);
+  pthread_mutex_lock (&l_pool.start);
+  for (t = 1; t < threads; t++)
+    if (pthread_create (&l_pool.tid[t], NULL, l_worker, &l_pool.band[t]))
+      {
+	printf ("Unable to create thread, expansion uses %d threads\n", t);
+	break;
+      }
+  threads = l_pool.threads = t;
+  pthread_barrier_init (&l_pool.barrier, NULL, threads);
 
-	  SET_OR_MASK;
-	}
-#ifdef SPEED_UP1
-      i += (mask & 1);
-#endif
+  for (t = 0; t < threads; t++)
+    {
+      l_pool.band[t].image = image;
+      l_pool.band[t].r0 = rows * t / threads;
+      l_pool.band[t].r1 = rows * (t + 1) / threads;
+      l_pool.band[t].rows = rows;
+      l_pool.band[t].match = match_mem + x + 2;
+      l_pool.band[t].row_match = row_match;
+      l_pool.band[t].barrier = &l_pool.barrier;
     }
-  printf ("diag_fill %d\n", count);
-  return count;
+  pthread_mutex_unlock (&l_pool.start);
 }
 
+static void
+l_pool_stop (void)
+{
+  int t;
 
+  if (!l_pool.band)
+    return;
+  l_pool.quit = 1;
+  pthread_barrier_wait (&l_pool.barrier);
+  for (t = 1; t < l_pool.threads; t++)
+    pthread_join (l_pool.tid[t], NULL);
+  pthread_barrier_destroy (&l_pool.barrier);
+  pthread_mutex_destroy (&l_pool.start);
+  free (l_pool.tid);
+  free (l_pool.band);
+  l_pool.band = NULL;
+  free (match_mem);
+  free (row_match);
+  match_mem = row_match = NULL;
+}
 
+static void
+l_rules_mt (struct image *image, const unsigned char *rules, int n,
+	    int *counts, int clean)
+{
+  struct l_band *band = l_pool.band;
+  int t, k;
+
+  stamp++;
+  for (t = 0; t < l_pool.threads; t++)
+    {
+      band[t].rules = rules;
+      band[t].n = n;
+      band[t].clean = clean;
+    }
+  // start sweep in workers, last barrier in l_band_thread() ends sweep
+  pthread_barrier_wait (&l_pool.barrier);
+  l_band_thread (&band[0]);
+
+  for (t = 0; t < l_pool.threads; t++)
+    for (k = 0; k < n; k++)
+      counts[k] += band[t].counts[k];
+}
 
+static void
+l_sweep (struct image *image, const unsigned char *rules, int n, int *counts,
+	 int clean)
+{
+  if (l_pool.threads > 1)
+    l_rules_mt (image, rules, n, counts, clean);
+  else
+    l_rules (image, rules, n, counts, clean);
+}
+
+/* words not changed since stamp "clean" are skipped, word is tested
+   again if scan returns to word */
 static int
-l_noexpand (struct image *image)
+l_noexpand (struct image *image, int clean)
 {
-  int i, count = 0;
+  int i, w, count = 0;
+  int word_from = 0, word_to = 0;
 
+  stamp++;
   for (i = image->x + 1; i < image->size;)
     {
+      if (i < word_from || i >= word_to)
+	{
+	  w = frontier_word (image, i, &word_to);
+	  word_from = i - (i % image->x) % (1 << F_SHIFT);
+	  if (word_stamp[w] < clean)
+	    {
+	      i = word_to;
+	      continue;
+	    }
+	}
+
       if ((image->or_mask[i - 1] & 1))
 	{
 	  i++;
@@ -363,13 +868,9 @@ l_noexpand (struct image *image)
 	}
 
 
-      switch (image->or_mask[i])
+      switch (expand_noexpand[image->or_mask[i]])
 	{
-
-	  //x.x
-	  //x.x
-	  //xxx
-	case 0xfb:
+	case NE_UP:
 	  SET_OR_MASK;
 	  if (i - image->x > 0)
 	    i -= image->x;
@@ -377,10 +878,7 @@ l_noexpand (struct image *image)
 	    i++;
 	  break;
 
-	  //xxx
-	  //x.x
-	  //x.x  
-	case 0xbf:
+	case NE_DOWN:
 	  SET_OR_MASK;
 	  if (i + image->x < image->size)
 	    i += image->x;
@@ -388,45 +886,17 @@ l_noexpand (struct image *image)
 	    i++;
 	  break;
 
-	  //xxx
-	  //..x
-	  //xxx
-	case 0xef:
+	case NE_LEFT:
 	  SET_OR_MASK;
 	  i--;
 	  break;
 
-/*   f1  f9  f3  1f  3f  9f  c7  cf  e7  fd  f7  df  7f 
-321  ... x.. ..x xxx xxx xxx .xx XXX .XX xx. .xx xxx xxx
-4 0  x.x x.x x.x x.x x.x x.x ..x ..X ..X x.x x.x x.x x.x
-567  xxx xxx xxx ... x.. ..x .xx .XX XXX xxx xxx .xx xx.
-*/
-	case 0xf1:
-	case 0xf9:
-	case 0xf3:
-	case 0x1f:
-	case 0x3f:
-	case 0x9f:
-	case 0xc7:
-	case 0xcf:
-	case 0xe7:
-	case 0xfd:
-	case 0xf7:
-	case 0xdf:
-	case 0x7f:
+	case NE_SKIP:
 	  SET_OR_MASK;
 	  i += 2;
 	  break;
 
-/*   7c  fe  7e  fc 
-321  xx. xxx XXX xx.
-4 0  x.. x.. x.. x..
-567  xx. xxx XX. xxx
-*/
-	case 0x7c:
-	case 0xfe:
-	case 0x7e:
-	case 0xfc:
+	case NE_NEXT:
 	  SET_OR_MASK;
 	default:
 	  i++;
@@ -437,191 +907,6 @@ l_noexpand (struct image *image)
   return count;
 }
 
-/*   e0   e1  f0 
-321  ...  ... ...
-4 0  ...  ..x x..
-567  xxx  xxx xxx
-
-x = copper
-*/
-
-static int
-l_up (struct image *image)
-{
-  int count = 0;
-  int i = 0;
-/*
-  if ((image->mask_data[1] & 0x10))
-    switch (image->mask_data[0])
-      {
-      case 0xe0:
-      case 0xe1:
-      case 0xf0:
-	SET_OR_MASK;
-      }
-*/
-  for (i = image->x + 1; i < image->size; i++)
-    {
-      if ((image->mask_data[i - 1] & 1))
-	continue;
-      switch (image->mask_data[i])
-	{
-	case 0xe0:
-	case 0xe1:
-	case 0xf0:
-	  SET_OR_MASK;
-	}
-
-#ifdef SPEED_UP1
-      i += (mask & 1);
-#endif
-    }
-  //printf ("up %d\n", count);
-  return count;
-}
-
-
-/*   0e   1e  0f    
-321  XXX  xxx xxx
-4 0  ...  x.. ..x
-567  ...  ... ...
-*/
-
-static int
-l_down (struct image *image)
-{
-  int count = 0;
-  int i;
-
-
-  for (i = image->x + 1; i < image->size; i++)
-    {
-      if ((image->mask_data[i - 1] & 1))
-	continue;
-
-      switch (image->mask_data[i])
-	{
-	case 0x0e:
-	case 0x1e:
-	case 0x0f:
-	  SET_OR_MASK;
-	}
-#ifdef SPEED_UP1
-      i += (mask & 1);
-#endif
-    }
-  //printf ("down %d\n", count);
-  return count;
-}
-
-
-
-/*   83   87  c3 
-321  ..x .xx ..x
-4 0  ..x ..x ..x
-567  ..x ..x .xx
-*/
-
-static int
-l_left (struct image *image)
-{
-  int count = 0;
-  int i;
-
-
-  for (i = image->x + 1; i < image->size; i++)
-    {
-      if ((image->mask_data[i - 1] & 1))
-	continue;
-
-      switch (image->mask_data[i])
-	{
-	case 0x83:
-	case 0x87:
-	case 0xc3:
-	  SET_OR_MASK;
-	  i++;
-	}
-    }
-  //printf ("left %d\n", count);
-  return count;
-}
-
-
-/*   38  3c  78   
-321  x.. xx. x..
-4 0  x.. x.. x..
-567  x.. x.. xx.
-*/
-
-static int
-l_right (struct image *image)
-{
-  int count = 0;
-  int i;
-
-  for (i = image->x + 1; i < image->size; i++)
-    {
-      if ((image->mask_data[i - 1] & 1))
-	continue;
-
-      switch (image->mask_data[i])
-	{
-	case 0x38:
-	case 0x3c:
-	case 0x78:
-	  SET_OR_MASK;
-	}
-    }
-  //printf ("right %d\n", count);
-  return count;
-}
-
-/*   1c  70  07  c1 
-321  xx. ... .xx ...
-4 0  x.. x.. ..x ..x
-567  ... xx. ... .xx
-*/
-
-/*    3e  8f  f8  e3
-321  XXX xxx x.. ..x
-4 0  X.. ..x x.. ..x
-567  X.. ..x xxx xxx
-*/
-
-
-static int
-l_rozok (struct image *image)
-{
-  int count = 0;
-  int i;
-
-  for (i = image->x + 1; i < image->size; i++)
-    {
-      if ((image->mask_data[i - 1] & 1))
-	continue;
-
-      switch (image->mask_data[i])
-	{
-	case 0x1c:
-	case 0x70:
-	case 0x07:
-	case 0xc1:
-
-	case 0x3e:
-	case 0x8f:
-	case 0xf8:
-	case 0xe3:
-	  SET_OR_MASK;
-	}
-#ifdef SPEED_UP1
-      i += (mask & 1);
-#endif
-    }
-  //printf ("rozok %d\n", count);
-  return count;
-}
-
 
 static void
 debug_dump_bit_image (struct image *image)
@@ -653,57 +938,56 @@ bit_e (struct image *image)
 {
 
   int flag = 0;
-  int i, j, k, ret, allret;
+  int j, ret, allret, frontier;
+  int clean_ne = 0, clean_rules = 0, sweep;
   struct timespec ts, ts_old, ts_diff;
+  static const unsigned char r_4to8[] = { R_4TO8 };
+  static const unsigned char r_all[] =
+    { R_DIAG, R_DIAG_FILL, R_UP, R_DOWN, R_LEFT, R_RIGHT, R_ROZOK };
+  int counts[7];
 
+  expand_rules_init ();
   image->size = image->x * (image->y - 2) - 2;
 
   clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts_old);
-  image->mask_data =
-    calloc (image->x * (image->y + 2), sizeof (unsigned char));
   image->or_mask = calloc (image->x * (image->y + 2), sizeof (unsigned char));
 
-  for (i = 0; i < image->size; i++)
-    image->or_mask[i] = get_mask (image, i, 70);
+  mask_plane (image, image->or_mask, 70);
+  frontier_init (image);
+  l_pool_start (image);
 
-  memcpy (image->mask_data, image->or_mask, image->size);
-
-  l_4to8 (image);
+  counts[0] = 0;
+  l_sweep (image, r_4to8, 1, counts, 0);
+  printf ("4to8 %d\n", counts[0]);
 
   for (j = 0;; j++)
     {
       allret = 0;
 
-      for (k = 0, ret = 1; ret; k++)
+      do
 	{
-	  ret = l_noexpand (image);
-	  memcpy (image->mask_data, image->or_mask, image->size);
+	  ret = l_noexpand (image, clean_ne);
 	  allret += ret;
 	}
+      while (ret);
+      clean_ne = stamp;
 
+      // diag and diag_fill only in first iteration
+      memset (counts, 0, sizeof (counts));
+      frontier = frontier_size (image, clean_rules);
+      sweep = stamp + 1;
       if (!flag)
 	{
-	  ret += l_diag (image);
-	  memcpy (image->mask_data, image->or_mask, image->size);
+	  l_sweep (image, r_all, 7, counts, 0);
+	  printf ("diag %d\n", counts[0]);
+	  printf ("diag_fill %d\n", counts[1]);
 	  flag++;
-	  ret += l_diag_fill (image);
-	  memcpy (image->mask_data, image->or_mask, image->size);
 	}
+      else
+	l_sweep (image, r_all + 2, 5, counts + 2, clean_rules);
+      clean_rules = sweep;
 
-      ret = l_up (image);
-      memcpy (image->mask_data, image->or_mask, image->size);
-
-      ret += l_down (image);
-      memcpy (image->mask_data, image->or_mask, image->size);
-
-      ret += l_left (image);
-      memcpy (image->mask_data, image->or_mask, image->size);
-
-      ret += l_right (image);
-      memcpy (image->mask_data, image->or_mask, image->size);
-
-      ret += l_rozok (image);
-      memcpy (image->mask_data, image->or_mask, image->size);
+      ret = counts[2] + counts[3] + counts[4] + counts[5] + counts[6];
 
       allret += ret;
       if (!allret)
@@ -711,8 +995,10 @@ bit_e (struct image *image)
 
       clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
       ts_diff = tsx_diff (ts_old, ts);
-      printf ("................... iteration %d, time %ld.%09ld", j,
-	      ts_diff.tv_sec, ts_diff.tv_nsec);
+      printf
+	("................... iteration %d, frontier %d, moved %ld, time %ld.%09ld",
+	 j, frontier, moved, ts_diff.tv_sec, ts_diff.tv_nsec);
+      moved = 0;
       ts_diff = tsx_diff (image->ts, ts);
       printf (" sum: %ld.%09ld\n", ts_diff.tv_sec, ts_diff.tv_nsec);
 
@@ -720,7 +1006,6 @@ bit_e (struct image *image)
       ts_old.tv_nsec = ts.tv_nsec;
     }
 
+  l_pool_stop ();
   printf ("all ok\n");
-  if (image->debug_files)
-    debug_dump_bit_image (image);
 }
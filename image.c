@@ -26,6 +26,7 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -118,6 +119,55 @@ file_read_uint (FILE * f)
   return i;
 }
 
+/*
+  Unpack P4 pixels from mmaped file (f is positioned at start of pixels)
+  to data and data_orig in one pass. File is unmapped before return,
+  input may be rewritten while pcb2g runs (input named out.pgm is
+  overwritten by img_write()). P5 is read by fread, mapping saves no
+  copy there.
+  Return 0 if ok, -1 if file can not be mapped (caller use fread).
+*/
+static int
+input_img_map (struct image *image, FILE * f)
+{
+  struct stat sb;
+  unsigned char *src, *d, *o;
+  long offset, line;
+  int x, y;
+  void *map;
+
+  offset = ftell (f);
+  if (offset < 0 || fstat (fileno (f), &sb) == -1 || !S_ISREG (sb.st_mode))
+    return -1;
+
+  line = image->x / 8 + ((image->x % 8) != 0);
+  if (sb.st_size < offset + line * image->y)
+    return -1;
+
+  map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno (f), 0);
+  if (map == MAP_FAILED)
+    return -1;
+  madvise (map, sb.st_size, MADV_SEQUENTIAL);
+  src = (unsigned char *) map + offset;
+
+  image->data_orig = malloc (sizeof (unsigned char) * image->x * image->y);
+  d = image->data;
+  o = image->data_orig;
+  for (y = 0; y < image->y; y++, src += line)
+    for (x = 0; x < image->x; x++)
+      *d++ = *o++ = (src[x / 8] & (128 >> (x % 8))) ? 0 : 255;
+
+  munmap (map, sb.st_size);
+  return 0;
+}
+
+void
+input_img_free_orig (struct image *image)
+{
+  free (image->data_orig);
+  image->data_orig = NULL;
+}
+
 int
 input_img_read (struct image *image, int flags)
 {
@@ -192,6 +242,13 @@ input_img_read (struct image *image, int flags)
     }
 
   image->data = malloc (sizeof (unsigned char) * image->x * image->y);
+
+  if (mode == 4 && 0 == input_img_map (image, f))
+    {
+      fclose (f);
+      return 0;
+    }
+
   image->data_orig = malloc (sizeof (unsigned char) * image->x * image->y);
 
   for (i = 0; i < image->y; i++)
@@ -0,0 +1,333 @@
+/*
+    label.c
+
+    This is part of pcb2g - pcb bitmap to G code converter
+
+    Copyright (C) 2011- 2015 Peter Popovec, popovec@fei.tuke.sk
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    connected component labelling (non copper regions)
+
+    Region is 4 connected set of non zero pixels. Image is converted to
+    runs (horizontal line of non zero pixels), runs overlapping in
+    neighbour rows are joined by union find. Runs are extracted in row
+    bands (one thread per band), bands are joined in second step.
+
+    Components are numbered in order of first pixel (same order as
+    regions are found by raster scan of image).
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pcb2g.h"
+
+struct label_band
+{
+  struct image *image;
+  int y0, y1;			// rows in band
+  struct label_run *run;
+  int *parent;
+  int runs, size;
+  int *row_first;		// global array, index y
+};
+
+static int
+label_find (int *parent, int i)
+{
+  int r = i, t;
+
+  while (parent[r] != r)
+    r = parent[r];
+  while (parent[i] != r)	// path compression
+    {
+      t = parent[i];
+      parent[i] = r;
+      i = t;
+    }
+  return r;
+}
+
+// root is always run with lower index (first in raster order)
+static void
+label_union (int *parent, int a, int b)
+{
+  a = label_find (parent, a);
+  b = label_find (parent, b);
+  if (a < b)
+    parent[b] = a;
+  else if (b < a)
+    parent[a] = b;
+}
+
+// join overlapping runs from two neighbour rows
+static void
+label_join_rows (struct label_run *run, int *parent, int a, int a_end, int b,
+		 int b_end)
+{
+  while (a < a_end && b < b_end)
+    {
+      if (run[a].x0 <= run[b].x1 && run[b].x0 <= run[a].x1)
+	label_union (parent, a, b);
+      if (run[a].x1 < run[b].x1)
+	a++;
+      else
+	b++;
+    }
+}
+
+static void *
+label_band_thread (void *arg)
+{
+  struct label_band *b = arg;
+  struct image *image = b->image;
+  unsigned char *d;
+  int x, y, prev = -1, first;
+
+  for (y = b->y0; y < b->y1; y++)
+    {
+      d = image->data + y * image->x;
+      first = b->runs;
+      b->row_first[y] = first;	// band local index, fixed later
+      for (x = 0; x < image->x; x++)
+	{
+	  if (!d[x])
+	    continue;
+	  if (b->runs == b->size)
+	    {
+	      b->size = b->size ? b->size * 2 : 1024;
+	      b->run = realloc (b->run, b->size * sizeof (struct label_run));
+	      b->parent = realloc (b->parent, b->size * sizeof (int));
+	    }
+	  b->run[b->runs].x0 = x;
+	  while (x + 1 < image->x && d[x + 1])
+	    x++;
+	  b->run[b->runs].x1 = x;
+	  b->run[b->runs].y = y;
+	  b->parent[b->runs] = b->runs;
+	  b->runs++;
+	}
+      if (prev >= 0)
+	label_join_rows (b->run, b->parent, prev, first, first, b->runs);
+      prev = first;
+    }
+  return NULL;
+}
+
+struct labels *
+image_label (struct image *image)
+{
+  struct labels *l;
+  struct label_band *band;
+  struct fill_data *c;
+  pthread_t *tid;
+  int threads = image->threads;
+  int t, i, y, r, off, started;
+  int *comp_of_root;
+
+  if (threads < 1)
+    threads = 1;
+  if (threads > image->y)
+    threads = image->y;
+
+  l = calloc (1, sizeof (struct labels));
+  l->image = image;
+  l->row_first = malloc ((image->y + 1) * sizeof (int));
+
+  band = calloc (threads, sizeof (struct label_band));
+  tid = calloc (threads, sizeof (pthread_t));
+  for (t = 0; t < threads; t++)
+    {
+      band[t].image = image;
+      band[t].y0 = image->y * t / threads;
+      band[t].y1 = image->y * (t + 1) / threads;
+      band[t].row_first = l->row_first;
+    }
+  for (t = 1; t < threads; t++)
+    if (pthread_create (&tid[t], NULL, label_band_thread, &band[t]))
+      break;
+  // bands without thread are extracted here
+  for (started = t; t < threads; t++)
+    label_band_thread (&band[t]);
+  label_band_thread (&band[0]);
+  for (t = 1; t < started; t++)
+    pthread_join (tid[t], NULL);
+
+  // concatenate bands
+  for (t = 0; t < threads; t++)
+    l->runs += band[t].runs;
+  l->run = malloc ((l->runs + 1) * sizeof (struct label_run));
+  l->parent = malloc ((l->runs + 1) * sizeof (int));
+  for (off = 0, t = 0; t < threads; off += band[t].runs, t++)
+    {
+      if (band[t].runs)
+	{
+	  memcpy (l->run + off, band[t].run,
+		  band[t].runs * sizeof (struct label_run));
+	  for (i = 0; i < band[t].runs; i++)
+	    l->parent[off + i] = band[t].parent[i] + off;
+	}
+      for (y = band[t].y0; y < band[t].y1; y++)
+	l->row_first[y] += off;
+      free (band[t].run);
+      free (band[t].parent);
+    }
+  l->row_first[image->y] = l->runs;
+
+  // join bands
+  for (t = 1; t < threads; t++)
+    {
+      y = band[t].y0;
+      if (y > 0 && y < image->y)
+	label_join_rows (l->run, l->parent, l->row_first[y - 1],
+			 l->row_first[y], l->row_first[y],
+			 l->row_first[y + 1]);
+    }
+  free (tid);
+  free (band);
+
+  // component table
+  comp_of_root = malloc ((l->runs + 1) * sizeof (int));
+  l->comp = malloc ((l->runs + 1) * sizeof (struct fill_data));
+  l->label = malloc ((l->runs + 1) * sizeof (int));
+  l->first = malloc ((l->runs + 1) * sizeof (int));
+  for (i = 0; i < l->runs; i++)
+    {
+      r = label_find (l->parent, i);
+      if (r == i)
+	{
+	  comp_of_root[i] = l->comps;
+	  l->first[l->comps] = i;
+	  c = &l->comp[l->comps++];
+	  c->xmin = l->run[i].x0;
+	  c->xmax = l->run[i].x1;
+	  c->ymin = c->ymax = l->run[i].y;
+	  c->count = 0;
+	  c->level = 0;
+	}
+      l->label[i] = comp_of_root[r];
+      c = &l->comp[l->label[i]];
+      if (c->xmin > l->run[i].x0)
+	c->xmin = l->run[i].x0;
+      if (c->xmax < l->run[i].x1)
+	c->xmax = l->run[i].x1;
+      if (c->ymax < l->run[i].y)
+	c->ymax = l->run[i].y;
+      c->count += l->run[i].x1 - l->run[i].x0 + 1;
+    }
+  free (comp_of_root);
+  return l;
+}
+
+// first run in row y with x1 >= x
+static int
+label_row_search (struct labels *l, int y, int x)
+{
+  int a = l->row_first[y], b = l->row_first[y + 1], m;
+
+  while (a < b)
+    {
+      m = (a + b) / 2;
+      if (l->run[m].x1 < x)
+	a = m + 1;
+      else
+	b = m;
+    }
+  return a;
+}
+
+/*
+  Fill depth (maximal stack level) of scanline seed fill of component c
+  started at first pixel of component. Fill takes seed from stack, fills
+  whole run and pushes one seed for each not filled run in row above and
+  below in range of filled run. Level 1 (no branches) is used for hole
+  detection.
+*/
+int
+label_level (struct labels *l, int c)
+{
+  int level = 0, max_level = 1;
+  int i, k, r, y, xmin, xmax;
+
+  // components are disjoint, filled flags are never cleared
+  if (!l->filled)
+    {
+      l->filled = calloc (l->runs + 1, 1);
+      l->stack_size = 1024;
+      l->stack = malloc (l->stack_size * sizeof (int));
+    }
+  l->stack[level++] = l->first[c];
+
+  while (level)
+    {
+      r = l->stack[--level];
+      l->filled[r] = 1;
+      xmin = l->run[r].x0;
+      xmax = l->run[r].x1;
+
+      // row above, then row below, seeds in x order
+      for (k = -1; k <= 1; k += 2)
+	{
+	  y = l->run[r].y + k;
+	  if (y < 0 || y >= l->image->y)
+	    continue;
+	  for (i = label_row_search (l, y, xmin);
+	       i < l->row_first[y + 1] && l->run[i].x0 <= xmax; i++)
+	    {
+	      if (l->filled[i])
+		continue;
+	      if (level == l->stack_size)
+		{
+		  l->stack_size *= 2;
+		  l->stack = realloc (l->stack, l->stack_size * sizeof (int));
+		}
+	      l->stack[level++] = i;
+	      if (level > max_level)
+		max_level = level;
+	    }
+	}
+    }
+  return max_level;
+}
+
+// fill all pixels of component with color[component]
+void
+label_remap (struct labels *l, unsigned char *color)
+{
+  int i;
+  struct label_run *run;
+
+  for (i = 0; i < l->runs; i++)
+    {
+      run = &l->run[i];
+      memset (l->image->data + run->y * l->image->x + run->x0,
+	      color[l->label[i]], run->x1 - run->x0 + 1);
+    }
+}
+
+void
+label_free (struct labels *l)
+{
+  free (l->run);
+  free (l->parent);
+  free (l->label);
+  free (l->first);
+  free (l->filled);
+  free (l->stack);
+  free (l->row_first);
+  free (l->comp);
+  free (l);
+}
@@ -0,0 +1,229 @@
+/*
+    mask.c
+
+    This is part of pcb2g - pcb bitmap to G code converter
+
+    Copyright (C) 2011- 2015 Peter Popovec, popovec@fei.tuke.sk
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    3x3 neighbour mask functions (shared by expand and trace code)
+
+    mask for index i describes pixel i + 1 + image->x, bit is set if
+    neighbour pixel is <= border:
+
+    321
+    4 0
+    567
+
+    mask_plane() calculates masks for whole image, SSE2 or AVX2 version
+    is selected once at program start, scalar version is used as fallback.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "pcb2g.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MASK_X86
+#endif
+
+unsigned char
+get_mask (struct image *image, int i, int border)
+{
+  unsigned char mask = 0;
+
+  if (*(image->data + i) <= border)
+    mask |= 1 << 3;
+  if (*(image->data + i + 1) <= border)
+    mask |= 1 << 2;
+  if (*(image->data + i + 2) <= border)
+    mask |= 1 << 1;
+  if (*(image->data + i + 2 + image->x) <= border)
+    mask |= 1 << 0;
+  if (*(image->data + i + image->x) <= border)
+    mask |= 1 << 4;
+  if (*(image->data + i + image->x + image->x) <= border)
+    mask |= 1 << 5;
+  if (*(image->data + i + 1 + image->x + image->x) <= border)
+    mask |= 1 << 6;
+  if (*(image->data + i + 2 + image->x + image->x) <= border)
+    mask |= 1 << 7;
+  return mask;
+}
+
+/* mask for indexes from "from" to "to" - 1, mask[0] is mask for "from" */
+static void
+mask_plane_scalar (struct image *image, unsigned char *mask, int from,
+		   int to, int border)
+{
+  int i;
+
+  for (i = from; i < to; i++)
+    mask[i - from] = get_mask (image, i, border);
+}
+
+#ifdef MASK_X86
+
+// data <= border -> 0xff, (saturated data - border is zero)
+#define M_SSE2(off,bit) \
+  t = _mm_loadu_si128 ((const __m128i *) (d + i + (off))); \
+  t = _mm_cmpeq_epi8 (_mm_subs_epu8 (t, b), z); \
+  m = _mm_or_si128 (m, _mm_and_si128 (t, _mm_set1_epi8 ((char) (bit))));
+
+__attribute__ ((target ("sse2")))
+static int
+mask_plane_sse2 (struct image *image, unsigned char *mask, int from,
+		 int to, int border)
+{
+  const unsigned char *d = image->data;
+  int x = image->x, i;
+  __m128i b, z, t, m;
+
+  b = _mm_set1_epi8 ((char) border);
+  z = _mm_setzero_si128 ();
+
+  for (i = from; i + 16 <= to; i += 16)
+    {
+      m = z;
+      M_SSE2 (0, 1 << 3);
+      M_SSE2 (1, 1 << 2);
+      M_SSE2 (2, 1 << 1);
+      M_SSE2 (2 + x, 1 << 0);
+      M_SSE2 (x, 1 << 4);
+      M_SSE2 (x + x, 1 << 5);
+      M_SSE2 (1 + x + x, 1 << 6);
+      M_SSE2 (2 + x + x, 1 << 7);
+      _mm_storeu_si128 ((__m128i *) (mask + i - from), m);
+    }
+  return i;
+}
+
+#define M_AVX2(off,bit) \
+  t = _mm256_loadu_si256 ((const __m256i *) (d + i + (off))); \
+  t = _mm256_cmpeq_epi8 (_mm256_subs_epu8 (t, b), z); \
+  m = _mm256_or_si256 (m, _mm256_and_si256 (t, _mm256_set1_epi8 ((char) (bit))));
+
+__attribute__ ((target ("avx2")))
+static int
+mask_plane_avx2 (struct image *image, unsigned char *mask, int from,
+		 int to, int border)
+{
+  const unsigned char *d = image->data;
+  int x = image->x, i;
+  __m256i b, z, t, m;
+
+  b = _mm256_set1_epi8 ((char) border);
+  z = _mm256_setzero_si256 ();
+
+  for (i = from; i + 32 <= to; i += 32)
+    {
+      m = z;
+      M_AVX2 (0, 1 << 3);
+      M_AVX2 (1, 1 << 2);
+      M_AVX2 (2, 1 << 1);
+      M_AVX2 (2 + x, 1 << 0);
+      M_AVX2 (x, 1 << 4);
+      M_AVX2 (x + x, 1 << 5);
+      M_AVX2 (1 + x + x, 1 << 6);
+      M_AVX2 (2 + x + x, 1 << 7);
+      _mm256_storeu_si256 ((__m256i *) (mask + i - from), m);
+    }
+  return i;
+}
+#endif
+
+// no SIMD code, all masks are calculated by scalar code
+static int
+mask_plane_none (struct image *image, unsigned char *mask, int from,
+		 int to, int border)
+{
+  return from;
+}
+
+static int (*mask_plane_simd) (struct image * image, unsigned char *mask,
+			       int from, int to, int border) =
+  mask_plane_none;
+
+#ifdef MASK_X86
+// select SIMD version before main(), mask_range() is called per row
+__attribute__ ((constructor))
+static void
+mask_plane_select (void)
+{
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    mask_plane_simd = mask_plane_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    mask_plane_simd = mask_plane_sse2;
+}
+#endif
+
+/*
+  calculate masks for indexes from .. to - 1 into mask[0 .. to - from - 1]
+  (part of image, for example one row)
+*/
+void
+mask_range (struct image *image, unsigned char *mask, int from, int to,
+	    int border)
+{
+  int done = from;
+
+  if (border > 255)		// all pixels match
+    border = 255;
+  if (border >= 0)		// no pixel match, only scalar code
+    done = mask_plane_simd (image, mask, from, to, border);
+  mask_plane_scalar (image, mask + done - from, done, to, border);
+}
+
+/*
+  calculate masks for all indexes 0 .. x*(y-2)-3 (same range as
+  image->size in expand code), mask must be allocated by caller
+*/
+void
+mask_plane (struct image *image, unsigned char *mask, int border)
+{
+  mask_range (image, mask, 0, image->x * (image->y - 2) - 2, border);
+}
+
+/*
+  pixel p is changed, border relation for this pixel is "set" (1 = pixel
+  is now <= border, 0 = pixel is over border), update mask of all
+  neighbours
+*/
+void
+mask_update (struct image *image, unsigned char *mask, int p, int set)
+{
+  int x = image->x;
+  int size = image->x * (image->y - 2) - 2;
+  int i, k;
+  // mask index of neighbour and bit for pixel p in neighbour mask
+  int n_i[8] = { p - x - 2, p - x, p - 2 * x - 2, p - 2 * x - 1,
+    p - 2 * x, p - 2, p - 1, p
+  };
+  static const unsigned char n_bit[8] =
+    { 0x01, 0x10, 0x80, 0x40, 0x20, 0x02, 0x04, 0x08 };
+
+  for (k = 0; k < 8; k++)
+    {
+      i = n_i[k];
+      if (i < 0 || i >= size)
+	continue;
+      if (set)
+	mask[i] |= n_bit[k];
+      else
+	mask[i] &= ~n_bit[k];
+    }
+}
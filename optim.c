@@ -23,6 +23,8 @@
 */
 #include <float.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #define __USE_XOPEN
 #include <math.h>
 #include "pcb2g.h"
@@ -31,30 +33,555 @@
 #include "pgeom.h"
 
 
-/* 
-calculate minimal distance from hole to isolation line
+/*
+  flat copy of all polylines for distance calculations (structure of
+  arrays), points of polyline k are at index off[k] .. off[k+1]-1,
+  rx,ry are real coordinates of points. Linked polylines are master copy,
+  arrays are rebuilt after polylines are changed.
 */
-static double
-hole_isolation_distance (struct image *image, struct hole *hole)
+static struct
+{
+  int points, polylines, size, p_size;
+  int *x, *y;
+  double *rx, *ry;
+  int *off;
+} soa;
+
+static void
+soa_build (struct image *image)
 {
-  double dist, min = DBL_MAX;
   struct polyline *ps;
   struct polyline_point *p;
+  int i, k;
+
+  for (i = 0, k = 0, ps = image->first_polyline; ps != NULL;
+       ps = ps->next, k++)
+    for (p = ps->points; p != NULL; p = p->next)
+      i++;
+  if (i > soa.size)
+    {
+      soa.size = i;
+      soa.x = realloc (soa.x, i * sizeof (int));
+      soa.y = realloc (soa.y, i * sizeof (int));
+      soa.rx = realloc (soa.rx, i * sizeof (double));
+      soa.ry = realloc (soa.ry, i * sizeof (double));
+    }
+  if (k + 1 > soa.p_size)
+    {
+      soa.p_size = k + 1;
+      soa.off = realloc (soa.off, (k + 1) * sizeof (int));
+    }
+  soa.points = i;
+  soa.polylines = k;
+  for (i = 0, k = 0, ps = image->first_polyline; ps != NULL;
+       ps = ps->next, k++)
+    {
+      ps->index = k;
+      soa.off[k] = i;
+      for (p = ps->points; p != NULL; p = p->next, i++)
+	{
+	  p->index = i;
+	  soa.x[i] = p->x;
+	  soa.y[i] = p->y;
+	  soa.rx[i] = i2realX (image, p->x / 2.0);
+	  soa.ry[i] = i2realY (image, p->y / 2.0);
+	}
+    }
+  soa.off[k] = i;
+}
+
+static void
+soa_free (void)
+{
+  free (soa.x);
+  free (soa.y);
+  free (soa.rx);
+  free (soa.ry);
+  free (soa.off);
+  memset (&soa, 0, sizeof (soa));
+}
+
+/*
+  squared distance from point i to line segment A,B (len2 = |AB|^2), -1 if
+  projection of point is not on segment (same as
+  lineParaSegmentToPointDistance2D()). sqrt is monotonic, sqrt of minimum
+  is same as minimum of sqrt. All coordinates are integers, projection
+  test can be done without division.
+*/
+static inline double
+para_point_dist2 (double Ax, double Ay, double Bx, double By, double len2,
+		  int i)
+{
+  double dx, dy, param;
+
+  param = ((soa.x[i] - Ax) * (Bx - Ax) + (soa.y[i] - Ay) * (By - Ay));
+  if (param > len2 || param < 0)
+    return -1;
+  param /= len2;
+  dx = Ax + param * (Bx - Ax) - soa.x[i];
+  dy = Ay + param * (By - Ay) - soa.y[i];
+  return dx * dx + dy * dy;
+}
+
+/*
+  uniform grid over points in flat arrays, used for clearance tests in
+  check_line(). Point with projection to segment in distance d is inside
+  bounding box of segment expanded by d, only cells in this box are
+  checked. Points removed by exclude_direct() are removed from grid and
+  from next[] (next live point in polyline), flat arrays are not rebuilt.
+*/
+static struct
+{
+  int x0, y0, cell, nx, ny;
+  int *start;			// first point in cell
+  int *cnt;			// live points in cell
+  int *item;			// point index
+  int *pos;			// position of point in item[]
+  int *next;
+  int active;
+} lg;
+
+static int
+lg_cell (int x, int y)
+{
+  return (x - lg.x0) / lg.cell + (y - lg.y0) / lg.cell * lg.nx;
+}
+
+static void
+lg_build (void)
+{
+  int i, c, k, x1, y1, w, h, *fill;
+
+  lg.x0 = x1 = soa.points ? soa.x[0] : 0;
+  lg.y0 = y1 = soa.points ? soa.y[0] : 0;
+  for (i = 1; i < soa.points; i++)
+    {
+      if (lg.x0 > soa.x[i])
+	lg.x0 = soa.x[i];
+      if (x1 < soa.x[i])
+	x1 = soa.x[i];
+      if (lg.y0 > soa.y[i])
+	lg.y0 = soa.y[i];
+      if (y1 < soa.y[i])
+	y1 = soa.y[i];
+    }
+  w = x1 - lg.x0 + 1;
+  h = y1 - lg.y0 + 1;
+  // about two points in one cell
+  lg.cell = sqrt (2.0 * w * h / (soa.points + 1)) + 1;
+  lg.nx = w / lg.cell + 1;
+  lg.ny = h / lg.cell + 1;
+
+  lg.start = calloc (lg.nx * lg.ny + 1, sizeof (int));
+  lg.cnt = calloc (lg.nx * lg.ny, sizeof (int));
+  lg.item = malloc ((soa.points + 1) * sizeof (int));
+  lg.pos = malloc ((soa.points + 1) * sizeof (int));
+  lg.next = malloc ((soa.points + 1) * sizeof (int));
+  for (i = 0; i < soa.points; i++)
+    lg.cnt[lg_cell (soa.x[i], soa.y[i])]++;
+  for (c = 0; c < lg.nx * lg.ny; c++)
+    lg.start[c + 1] = lg.start[c] + lg.cnt[c];
+  fill = malloc (lg.nx * lg.ny * sizeof (int));
+  memcpy (fill, lg.start, lg.nx * lg.ny * sizeof (int));
+  for (i = 0; i < soa.points; i++)
+    {
+      c = lg_cell (soa.x[i], soa.y[i]);
+      lg.pos[i] = fill[c];
+      lg.item[fill[c]++] = i;
+    }
+  free (fill);
+  for (k = 0; k < soa.polylines; k++)
+    {
+      for (i = soa.off[k]; i < soa.off[k + 1] - 1; i++)
+	lg.next[i] = i + 1;
+      if (soa.off[k + 1] > soa.off[k])
+	lg.next[soa.off[k + 1] - 1] = -1;
+    }
+  lg.active = 1;
+}
+
+static void
+lg_free (void)
+{
+  free (lg.start);
+  free (lg.cnt);
+  free (lg.item);
+  free (lg.pos);
+  free (lg.next);
+  memset (&lg, 0, sizeof (lg));
+}
+
+static void
+lg_remove (int i)
+{
+  int c = lg_cell (soa.x[i], soa.y[i]);
+  int k = lg.pos[i];
+  int last = lg.start[c] + --lg.cnt[c];
+
+  lg.item[k] = lg.item[last];
+  lg.pos[lg.item[k]] = k;
+}
+
+/*
+  minimal squared distance from all live points except skip_from ..
+  skip_to-1 to line segment A,B, only points in distance below
+  sqrt(bound) (or below result) are guaranteed to be checked. If bound and
+  result are DBL_MAX, box is expanded until some point is found or whole
+  grid is checked. Point with minimal distance is stored in arg.
+*/
+static double
+lg_segment_min2 (double Ax, double Ay, double Bx, double By,
+		 int skip_from, int skip_to, double min, double bound, int *arg)
+{
+  double dist, b, r = lg.cell;
+  double len2 = (Bx - Ax) * (Bx - Ax) + (By - Ay) * (By - Ay);
+  int cx0, cy0, cx1, cy1, cx, cy, c, k, i;
+
+  if (len2 == 0)
+    return min;
+  for (;;)
+    {
+      b = min < bound ? min : bound;
+      if (b != DBL_MAX)
+	r = sqrt (b) + 1;
+      cx0 = floor (((Ax < Bx ? Ax : Bx) - r - lg.x0) / lg.cell);
+      cx1 = floor (((Ax > Bx ? Ax : Bx) + r - lg.x0) / lg.cell);
+      cy0 = floor (((Ay < By ? Ay : By) - r - lg.y0) / lg.cell);
+      cy1 = floor (((Ay > By ? Ay : By) + r - lg.y0) / lg.cell);
+      if (cx0 < 0)
+	cx0 = 0;
+      if (cy0 < 0)
+	cy0 = 0;
+      if (cx1 >= lg.nx)
+	cx1 = lg.nx - 1;
+      if (cy1 >= lg.ny)
+	cy1 = lg.ny - 1;
+      for (cy = cy0; cy <= cy1; cy++)
+	for (cx = cx0; cx <= cx1; cx++)
+	  {
+	    c = cx + cy * lg.nx;
+	    for (k = lg.start[c]; k < lg.start[c] + lg.cnt[c]; k++)
+	      {
+		i = lg.item[k];
+		if (i >= skip_from && i < skip_to)
+		  continue;
+		dist = para_point_dist2 (Ax, Ay, Bx, By, len2, i);
+		if (dist >= 0 && dist < min)
+		  {
+		    min = dist;
+		    *arg = i;
+		  }
+	      }
+	  }
+      b = min < bound ? min : bound;
+      if (b != DBL_MAX && sqrt (b) + 1 <= r)
+	return min;
+      if (cx0 == 0 && cy0 == 0 && cx1 == lg.nx - 1 && cy1 == lg.ny - 1)
+	return min;
+      r *= 2;
+    }
+}
+
+/*
+  run fcion for all items in image->threads threads, items are taken by
+  threads one by one (shared counter). Each item is processed by one
+  thread, results are stored in item and used by caller in list order,
+  result is same for any number of threads.
+*/
+struct o_work
+{
+  struct image *image;
+  void **item;
+  int items;
+  int next;
+  void (*fcion) (struct image * image, void *item);
+};
+
+static void *
+o_thread (void *arg)
+{
+  struct o_work *w = arg;
+  int i;
+
+  while ((i = __sync_fetch_and_add (&w->next, 1)) < w->items)
+    (w->fcion) (w->image, w->item[i]);
+  return NULL;
+}
+
+static void
+o_parallel (struct image *image, void **item, int items,
+	    void (*fcion) (struct image * image, void *item))
+{
+  struct o_work w = { image, item, items, 0, fcion };
+  int threads = image->threads, t;
+  pthread_t *tid;
+
+  if (threads > items)
+    threads = items;
+  if (threads < 1)
+    threads = 1;
+  tid = calloc (threads, sizeof (pthread_t));
+  // items are taken from shared counter, if thread can not be created,
+  // work is done by threads started so far
+  for (t = 1; t < threads; t++)
+    if (pthread_create (&tid[t], NULL, o_thread, &w))
+      break;
+  threads = t;
+  o_thread (&w);
+  for (t = 1; t < threads; t++)
+    pthread_join (tid[t], NULL);
+  free (tid);
+}
+
+// array of all polylines (or holes) for o_parallel()
+static void **
+o_polylines (struct image *image, int *n)
+{
+  struct polyline *ps;
+  void **item;
+  int i = 0;
 
   for (ps = image->first_polyline; ps != NULL; ps = ps->next)
-    for (p = ps->points; p->next != NULL; p = p->next)
-      {
-	dist =
-	  lineSegmentToPointDistance2D
-	  (i2realX (image, p->x / 2.0),
-	   i2realY (image, p->y / 2.0),
-	   i2realX (image, p->next->x / 2.0),
-	   i2realY (image, p->next->y / 2.0), hole->fx, hole->fy);
-	if (dist < min)
-	  min = dist;
-      }
+    i++;
+  item = malloc ((i + 1) * sizeof (void *));
+  for (i = 0, ps = image->first_polyline; ps != NULL; ps = ps->next)
+    item[i++] = ps;
+  *n = i;
+  return item;
+}
+
+static void **
+o_holes (struct image *image, int *n)
+{
+  struct hole *hole;
+  void **item;
+  int i = 0;
+
+  for (hole = image->first_hole; hole != NULL; hole = hole->next)
+    i++;
+  item = malloc ((i + 1) * sizeof (void *));
+  for (i = 0, hole = image->first_hole; hole != NULL; hole = hole->next)
+    item[i++] = hole;
+  *n = i;
+  return item;
+}
+
+/*
+  uniform grid (real coordinates) shared by hole to isolation line
+  distance calculations. Segments of polylines (i, i+1 in flat arrays)
+  are stored in all cells overlapped by segment bounding box, holes are
+  stored in all cells overlapped by bounding box of circle with radius
+  hole_to_line. Segment lists are used only by holes2isolation().
+*/
+static struct
+{
+  double x0, y0, cell;
+  int nx, ny;
+  int *seg_start, *seg;		// segments in cell (CSR)
+  int *hole_start;		// holes in cell (CSR)
+  struct hole **hole;
+} hg;
+
+// cell column/row for real coordinate, clamped to grid
+static int
+hg_cx (double x)
+{
+  x = (x - hg.x0) / hg.cell;
+  if (x < 0)
+    return 0;
+  if (x >= hg.nx)
+    return hg.nx - 1;
+  return x;
+}
+
+static int
+hg_cy (double y)
+{
+  y = (y - hg.y0) / hg.cell;
+  if (y < 0)
+    return 0;
+  if (y >= hg.ny)
+    return hg.ny - 1;
+  return y;
+}
+
+// cell range of box x0,y0 - x1,y1 expanded by r
+static void
+hg_box (double x0, double y0, double x1, double y1, double r, int *c)
+{
+  c[0] = hg_cx ((x0 < x1 ? x0 : x1) - r);
+  c[1] = hg_cy ((y0 < y1 ? y0 : y1) - r);
+  c[2] = hg_cx ((x0 > x1 ? x0 : x1) + r);
+  c[3] = hg_cy ((y0 > y1 ? y0 : y1) + r);
+}
+
+static void
+hg_build (struct image *image)
+{
+  struct hole *hole;
+  double x1, y1;
+  int i, k, x, y, n = 0, pass, c[4], *cnt;
+
+  hg.x0 = x1 = soa.points ? soa.rx[0] : 0;
+  hg.y0 = y1 = soa.points ? soa.ry[0] : 0;
+  for (i = 0; i < soa.points; i++)
+    {
+      if (hg.x0 > soa.rx[i])
+	hg.x0 = soa.rx[i];
+      if (x1 < soa.rx[i])
+	x1 = soa.rx[i];
+      if (hg.y0 > soa.ry[i])
+	hg.y0 = soa.ry[i];
+      if (y1 < soa.ry[i])
+	y1 = soa.ry[i];
+    }
+  for (hole = image->first_hole; hole != NULL; hole = hole->next)
+    {
+      if (hg.x0 > hole->fx)
+	hg.x0 = hole->fx;
+      if (x1 < hole->fx)
+	x1 = hole->fx;
+      if (hg.y0 > hole->fy)
+	hg.y0 = hole->fy;
+      if (y1 < hole->fy)
+	y1 = hole->fy;
+    }
+  // about two segments in one cell
+  hg.cell = sqrt (2.0 * (x1 - hg.x0) * (y1 - hg.y0) / (soa.points + 1));
+  if (hg.cell < (x1 - hg.x0) / (2.0 * soa.points + 2))
+    hg.cell = (x1 - hg.x0) / (2.0 * soa.points + 2);
+  if (hg.cell < (y1 - hg.y0) / (2.0 * soa.points + 2))
+    hg.cell = (y1 - hg.y0) / (2.0 * soa.points + 2);
+  if (hg.cell <= 0)
+    hg.cell = 1;
+  hg.nx = (x1 - hg.x0) / hg.cell + 1;
+  hg.ny = (y1 - hg.y0) / hg.cell + 1;
+
+  // count, then fill
+  hg.seg_start = calloc (hg.nx * hg.ny + 1, sizeof (int));
+  cnt = calloc (hg.nx * hg.ny, sizeof (int));
+  for (pass = 0; pass < 2; pass++)
+    {
+      for (k = 0; k < soa.polylines; k++)
+	for (i = soa.off[k]; i < soa.off[k + 1] - 1; i++)
+	  {
+	    hg_box (soa.rx[i], soa.ry[i], soa.rx[i + 1], soa.ry[i + 1], 0, c);
+	    for (y = c[1]; y <= c[3]; y++)
+	      for (x = c[0]; x <= c[2]; x++)
+		if (pass)
+		  hg.seg[cnt[x + y * hg.nx]++] = i;
+		else
+		  hg.seg_start[x + y * hg.nx + 1]++;
+	  }
+      if (pass)
+	break;
+      for (i = 0; i < hg.nx * hg.ny; i++)
+	{
+	  hg.seg_start[i + 1] += hg.seg_start[i];
+	  cnt[i] = hg.seg_start[i];
+	}
+      n = hg.seg_start[hg.nx * hg.ny];
+      hg.seg = malloc ((n + 1) * sizeof (int));
+    }
+  free (cnt);
+}
+
+// store holes, hole_to_line must be calculated
+static void
+hg_holes (struct image *image)
+{
+  struct hole *hole;
+  int i, x, y, n, pass, c[4], *cnt;
+
+  hg.hole_start = calloc (hg.nx * hg.ny + 1, sizeof (int));
+  cnt = calloc (hg.nx * hg.ny, sizeof (int));
+  for (pass = 0; pass < 2; pass++)
+    {
+      for (hole = image->first_hole; hole != NULL; hole = hole->next)
+	{
+	  hg_box (hole->fx, hole->fy, hole->fx, hole->fy,
+		  hole->hole_to_line, c);
+	  for (y = c[1]; y <= c[3]; y++)
+	    for (x = c[0]; x <= c[2]; x++)
+	      if (pass)
+		hg.hole[cnt[x + y * hg.nx]++] = hole;
+	      else
+		hg.hole_start[x + y * hg.nx + 1]++;
+	}
+      if (pass)
+	break;
+      for (i = 0; i < hg.nx * hg.ny; i++)
+	{
+	  hg.hole_start[i + 1] += hg.hole_start[i];
+	  cnt[i] = hg.hole_start[i];
+	}
+      n = hg.hole_start[hg.nx * hg.ny];
+      hg.hole = malloc ((n + 1) * sizeof (struct hole *));
+    }
+  free (cnt);
+  free (hg.seg_start);
+  free (hg.seg);
+  hg.seg_start = hg.seg = NULL;
+}
+
+static void
+hg_free (void)
+{
+  free (hg.seg_start);
+  free (hg.seg);
+  free (hg.hole_start);
+  free (hg.hole);
+  memset (&hg, 0, sizeof (hg));
+}
+
+/* 
+calculate minimal distance from hole to isolation line, cells are
+checked in rings around hole, segment not in rings 0..k is in distance
+over (k - 1) * cell
+*/
+static void
+hole_isolation_distance (struct image *image, void *item)
+{
+  struct hole *hole = item;
+  double dist, min = DBL_MAX;
+  int cx, cy, k, x, y, c, i;
+
+  cx = hg_cx (hole->fx);
+  cy = hg_cy (hole->fy);
+  for (k = 0; k <= hg.nx || k <= hg.ny; k++)
+    {
+      if (min + 0.000001 < (k - 1) * hg.cell)
+	break;
+      for (y = cy - k; y <= cy + k; y++)
+	{
+	  if (y < 0 || y >= hg.ny)
+	    continue;
+	  for (x = cx - k; x <= cx + k; x++)
+	    {
+	      if (x < 0 || x >= hg.nx)
+		continue;
+	      // ring only
+	      if (y != cy - k && y != cy + k && x != cx - k && x != cx + k)
+		{
+		  x = cx + k;
+		  if (x >= hg.nx)
+		    break;
+		}
+	      c = x + y * hg.nx;
+	      for (i = hg.seg_start[c]; i < hg.seg_start[c + 1]; i++)
+		{
+		  dist =
+		    lineSegmentToPointDistance2D
+		    (soa.rx[hg.seg[i]], soa.ry[hg.seg[i]],
+		     soa.rx[hg.seg[i] + 1], soa.ry[hg.seg[i] + 1],
+		     hole->fx, hole->fy);
+		  if (dist < min)
+		    min = dist;
+		}
+	    }
+	}
+    }
   hole->hole_to_line = min;
-  return min;
 }
 
 /* for all holes calculate minimum distance center-isolation line */
@@ -64,10 +591,17 @@ holes2isolation (struct image *image)
 {
   struct hole *hole, *hole_min = NULL;
   double dist, min = DBL_MAX;
-
+  void **item;
+  int n;
+
+  hg_build (image);
+  item = o_holes (image, &n);
+  o_parallel (image, item, n, &hole_isolation_distance);
+  free (item);
+  hg_holes (image);
   for (hole = image->first_hole; hole != NULL; hole = hole->next)
     {
-      dist = hole_isolation_distance (image, hole);
+      dist = hole->hole_to_line;
       if (dist < min)
 	{
 	  min = dist;
@@ -95,27 +629,116 @@ traverse_tree (struct image *image, struct polyline_tree *tree,
 }
 
 
+/*
+  check_line() results are cached (by tree id). Result depends only on
+  points with minimal old and new distance and on points of own
+  polyline. Trees are registered in dependency list of these points,
+  removed point invalidates all trees in its list, all trees of changed
+  polyline are invalidated by exclusion loop.
+*/
+static struct
+{
+  char *valid, *clear;		// per tree id
+  int trees;
+  int *head;			// per point, first link
+  int *link_id, *link_next;
+  int links, size;
+} dep;
+
+static void
+dep_number (struct image *image, struct polyline_tree *tree)
+{
+  tree->id = dep.trees++;
+}
+
+static void
+dep_build (struct image *image)
+{
+  struct polyline *ps;
+
+  dep.trees = 0;
+  for (ps = image->first_polyline; ps != NULL; ps = ps->next)
+    traverse_tree (image, ps->tree, &dep_number);
+  dep.valid = calloc (dep.trees + 1, 1);
+  dep.clear = calloc (dep.trees + 1, 1);
+  dep.head = malloc ((soa.points + 1) * sizeof (int));
+  memset (dep.head, -1, (soa.points + 1) * sizeof (int));
+}
+
+static void
+dep_free (void)
+{
+  free (dep.valid);
+  free (dep.clear);
+  free (dep.head);
+  free (dep.link_id);
+  free (dep.link_next);
+  memset (&dep, 0, sizeof (dep));
+}
+
+static void
+dep_add (int i, int id)
+{
+  if (i < 0)
+    return;
+  if (dep.links == dep.size)
+    {
+      dep.size = dep.size ? dep.size * 2 : 1024;
+      dep.link_id = realloc (dep.link_id, dep.size * sizeof (int));
+      dep.link_next = realloc (dep.link_next, dep.size * sizeof (int));
+    }
+  dep.link_id[dep.links] = id;
+  dep.link_next[dep.links] = dep.head[i];
+  dep.head[i] = dep.links++;
+}
+
+// point i is removed, invalidate dependent trees
+static void
+dep_remove (int i)
+{
+  int k;
+
+  for (k = dep.head[i]; k >= 0; k = dep.link_next[k])
+    dep.valid[dep.link_id[k]] = 0;
+  dep.head[i] = -1;
+}
+
+static void
+dep_invalidate (struct image *image, struct polyline_tree *tree)
+{
+  dep.valid[tree->id] = 0;
+}
+
+
 /* check line to all holes distance, if some of distance is below old distance
-return 1 to signalize "wrong" optimization" */
+return 1 to signalize "wrong" optimization", only holes stored in cells
+overlapped by line bounding box can be closer than hole_to_line */
 
 static void
 holeToLine (struct image *image, struct polyline_tree *tree)
 {
   struct hole *h;
-
-  for (h = image->first_hole; h != NULL; h = h->next)
-    {
-      if ((lineSegmentToPointDistance2D
-	   (i2realX (image, tree->start->x / 2.0),
-	    i2realY (image, tree->start->y / 2.0),
-	    i2realX (image, tree->end->x / 2.0),
-	    i2realY (image, tree->end->y / 2.0),
-	    h->fx, h->fy) + 0.0000001) < h->hole_to_line)
+  double x0, y0, x1, y1;
+  int c[4], x, y, i;
+
+  x0 = i2realX (image, tree->start->x / 2.0);
+  y0 = i2realY (image, tree->start->y / 2.0);
+  x1 = i2realX (image, tree->end->x / 2.0);
+  y1 = i2realY (image, tree->end->y / 2.0);
+  hg_box (x0, y0, x1, y1, 0, c);
+  for (y = c[1]; y <= c[3]; y++)
+    for (x = c[0]; x <= c[2]; x++)
+      for (i = hg.hole_start[x + y * hg.nx];
+	   i < hg.hole_start[x + y * hg.nx + 1]; i++)
 	{
-	  tree->direct = -1;
-	  return;
+	  h = hg.hole[i];
+	  if ((lineSegmentToPointDistance2D (x0, y0, x1, y1, h->fx, h->fy)
+	       + 0.0000001) < h->hole_to_line)
+	    {
+	      tree->direct = -1;
+	      return;
+	    }
 	}
-    }
   return;
 }
 
@@ -232,11 +855,13 @@ not_diagonal:
   if (!pmax)
     return;
 
-  tree->left = calloc (sizeof (struct polyline_tree), 1);
+  tree->left =
+    arena_alloc (image, ARENA_TREE, sizeof (struct polyline_tree));
   tree->left->start = tree->start;
   tree->left->end = pmax;
   tree->left->level = 1 + tree->level;
-  tree->right = calloc (sizeof (struct polyline_tree), 1);
+  tree->right =
+    arena_alloc (image, ARENA_TREE, sizeof (struct polyline_tree));
   tree->right->start = pmax;
   tree->right->end = tree->end;
   tree->right->level = 1 + tree->level;
@@ -251,13 +876,10 @@ not_diagonal:
 static void
 check_line (struct image *image, struct polyline_tree *tree)
 {
-  struct polyline *ps;
-  struct polyline_point *p, *px;
-
   double new_min;
   double old_min;
-  double dist;
   double count;
+  int i, h, old_arg = -1, new_arg = -1;
 
   old_min = new_min = DBL_MAX;
 
@@ -265,123 +887,132 @@ check_line (struct image *image, struct polyline_tree *tree)
   if (tree->direct < 0)
     return;
 
-  count = bres_line_test
-    (image, tree->start->x / 2, tree->start->y / 2, tree->end->x / 2,
-     tree->end->y / 2);
+  if (!dep.valid[tree->id])
+    {
+      count = bres_line_test
+	(image, tree->start->x / 2, tree->start->y / 2, tree->end->x / 2,
+	 tree->end->y / 2);
 
 //crossing copper ? 
-  if (count == -1)
-    {
-      tree->direct = -1;
-      return;
-    }
+      if (count == -1)
+	{
+	  tree->direct = -1;
+	  return;
+	}
 
-  if (tree->right && tree->left && image->route_optimize > 2)
-    if (tree->sig < (tree->right->sig + tree->left->sig))
-      tree->direct = 1;
+      if (tree->right && tree->left && image->route_optimize > 2)
+	if (tree->sig < (tree->right->sig + tree->left->sig))
+	  tree->direct = 1;
 
 /* check old distance - all lines to line segments in "tree" */
-  for (ps = image->first_polyline; ps != NULL; ps = ps->next)
+      h = tree->start->head->index;
+      for (i = tree->start->index; lg.next[i] != tree->end->index;
+	   i = lg.next[i])
+	old_min =
+	  lg_segment_min2 (soa.x[i], soa.y[i], soa.x[lg.next[i]],
+			   soa.y[lg.next[i]], soa.off[h], soa.off[h + 1],
+			   old_min, DBL_MAX, &old_arg);
+
+/* check new distance all lines to line from start to end in "tree",
+   only distance below old distance is needed */
+      new_min = lg_segment_min2 (tree->start->x, tree->start->y,
+				 tree->end->x, tree->end->y,
+				 tree->start->index, tree->end->index + 1,
+				 new_min, old_min, &new_arg);
+      if (old_min != DBL_MAX)
+	old_min = sqrt (old_min);
+      if (new_min != DBL_MAX)
+	new_min = sqrt (new_min);
+      dep.clear[tree->id] = new_min > 0 && new_min >= old_min;
+      dep.valid[tree->id] = 1;
+      dep_add (old_arg, tree->id);
+      dep_add (new_arg, tree->id);
+    }
+  if (dep.clear[tree->id])
     {
-      // TODO self 
-      if (tree->start->head == ps)
-	continue;
-      for (p = ps->points; p != NULL; p = p->next)
-	{
-	  for (px = tree->start; px->next != tree->end; px = px->next)
-	    {
-	      dist =
-		lineParaSegmentToPointDistance2D (px->x, px->y, px->next->x,
-						  px->next->y, p->x, p->y);
-
-	      if (dist < old_min)
-		old_min = dist;
-	    }
-	}
+      tree->direct = 1;		//mark posible optimization
+      if (tree->start->head->optimized_count < tree->components)
+	tree->start->head->optimized_count = tree->components;
     }
+}
 
-/* check new distance all lines to line from start to end in "tree" */
-  for (ps = image->first_polyline; ps != NULL; ps = ps->next)
-    for (p = ps->points; p != NULL; p = p->next)
-      {
-	//skip self 
-	if (p == tree->start)
-	  {
-	    while (p != tree->end)
-	      p = p->next;
-	    continue;
-	  }
-	dist =
-	  lineParaSegmentToPointDistance2D (tree->start->x, tree->start->y,
-					    tree->end->x, tree->end->y, p->x,
-					    p->y);
-	if (dist < new_min)
-	  new_min = dist;
-      }
-  if (new_min > 0)
-    if (new_min >= old_min)
-      {
-	tree->direct = 1;	//mark posible optimization
-	if (tree->start->head->optimized_count < tree->components)
-	  tree->start->head->optimized_count = tree->components;
-      }
+/* create tree for this polyline, divide polylines by maximal deviation */
+static void
+polyline_tree1 (struct image *image, void *item)
+{
+  struct polyline *ps = item;
+  struct polyline_point *p;
+
+  //printf ("===========================\n");
+  ps->tree = arena_alloc (image, ARENA_TREE, sizeof (struct polyline_tree));
+  ps->tree->start = ps->points;
+  for (p = ps->points; p->next != NULL; p = p->next);
+  ps->tree->end = p;
+
+  polyline_tree0 (image, ps->tree);
 }
 
 static void
 polyline_tree (struct image *image)
 {
+  void **item;
+  int n;
 
-  struct polyline *ps;
-  struct polyline_point *p;
-
-/* create tree for this polyline, divide polylines by maximal deviation */
   printf ("OPTIMIZE creating path tree\n");
-  for (ps = image->first_polyline; ps != NULL; ps = ps->next)
-    {
-      //printf ("===========================\n");
-      ps->tree = calloc (sizeof (struct polyline_tree), 1);
-      ps->tree->start = ps->points;
-      for (p = ps->points; p->next != NULL; p = p->next);
-      ps->tree->end = p;
+  item = o_polylines (image, &n);
+  o_parallel (image, item, n, &polyline_tree1);
+  free (item);
+}
 
-      polyline_tree0 (image, ps->tree);
-    }
+static void
+hole_to_line_tree (struct image *image, void *item)
+{
+  struct polyline *ps = item;
+
+  traverse_tree (image, ps->tree, &holeToLine);
 }
 
 /* exclude this subtree from polygon tree */
 
 static void
-exclude_tree (struct polyline_tree *tree)
+exclude_tree (struct image *image, struct polyline_tree *tree)
 {
 
   if (tree->left)
     {
-      exclude_tree (tree->left);
-      free (tree->left);
+      exclude_tree (image, tree->left);
+      arena_free (image, ARENA_TREE, tree->left);
       tree->left = NULL;
     }
   if (tree->right)
     {
-      exclude_tree (tree->right);
-      free (tree->right);
+      exclude_tree (image, tree->right);
+      arena_free (image, ARENA_TREE, tree->right);
       tree->right = NULL;
     }
 }
 
 /* exclude and dealloc path components between start and end */
 static void
-exclude_path_nodes (struct polyline_tree *tree)
+exclude_path_nodes (struct image *image, struct polyline_tree *tree)
 {
 
   struct polyline_point *p, *p_next;
 
   p = tree->start->next;
   tree->start->next = tree->end;
+  if (lg.active)
+    lg.next[tree->start->index] = tree->end->index;
 
   while (p != tree->end)
     {
       p_next = p->next;
-      free (p);
+      if (lg.active)
+	{
+	  lg_remove (p->index);
+	  dep_remove (p->index);
+	}
+      arena_free (image, ARENA_POINT, p);
       p = p_next;
     }
 }
@@ -389,8 +1020,8 @@ exclude_path_nodes (struct polyline_tree *tree)
 static void
 exclude_path (struct image *image, struct polyline_tree *tree)
 {
-  exclude_path_nodes (tree);
-  exclude_tree (tree);
+  exclude_path_nodes (image, tree);
+  exclude_tree (image, tree);
 }
 
 
@@ -408,11 +1039,13 @@ void
 optim (struct image *image)
 {
   struct polyline *ps, *ps_max;
-  int max;
+  int max, n;
+  void **item;
 
   if (image->route_optimize < 0)	// for debug only, do optimization
     return;
 
+  soa_build (image);
   printf ("OPTIMIZE calculating minimal hole to isolation distance\n");
   holes2isolation (image);
   polyline_tree (image);
@@ -424,12 +1057,20 @@ optim (struct image *image)
 
 //check optimization level.. 
   if (image->route_optimize < 2)
-    return;
+    {
+      hg_free ();
+      soa_free ();
+      return;
+    }
 
   printf ("OPTIMIZE checking tree isolation line to holes distances\n");
-  for (ps = image->first_polyline; ps != NULL; ps = ps->next)
-    traverse_tree (image, ps->tree, &holeToLine);
+  item = o_polylines (image, &n);
+  o_parallel (image, item, n, &hole_to_line_tree);
+  free (item);
 
+  soa_build (image);
+  lg_build ();
+  dep_build (image);
   for (;;)
     {
       //calculate distances to other points and mark tree->direct by 1 if can be optimized
@@ -452,9 +1093,14 @@ optim (struct image *image)
 	break;
 
       traverse_tree (image, ps_max->tree, &exclude_direct);
+      traverse_tree (image, ps_max->tree, &dep_invalidate);
       for (ps = image->first_polyline; ps != NULL; ps = ps->next)
 	ps->optimized_count = 0;
       printf ("OPTIMIZE excluded %d\n", max);
 
     }
+  dep_free ();
+  lg_free ();
+  hg_free ();
+  soa_free ();
 }
@@ -66,39 +66,41 @@ image_crc (struct image *image)
   snprintf (image->crc, 5, "%04X", crc);
 }
 
-double
-i2realX (struct image *image, int x)
+// pixel to mm transform, used by i2realX(), i2realY()
+void
+i2real_init (struct image *image)
 {
   if (image->real_x > 0 && image->real_y > 0)
     {
-      return ((double) x * image->real_x) / (double) (image->x);
+      image->mm_mul_x = image->real_x;
+      image->mm_mul_y = image->real_y;
+      image->mm_div_x = image->x;
+      image->mm_div_y = image->y;
+      image->mm_div = 1.0;
     }
   else
-    return (double) x *127.0 / (double) image->dpi / 5.0;
-}
-
-double
-i2realY (struct image *image, int y)
-{
-  if (image->real_x > 0 && image->real_y > 0)
     {
-      return ((double) y * image->real_y) / (double) (image->y);
+      image->mm_mul_x = image->mm_mul_y = 127.0;
+      image->mm_div_x = image->mm_div_y = image->dpi;
+      image->mm_div = 5.0;
     }
-  else
-    return (double) y *127.0 / (double) image->dpi / 5.0;
 }
 
 int
 main (int argc, char *argv[])
 {
 
-  int sx, sy;
+  int sx;
   int opt;
 
   struct image *image, *image_fast;
   struct fill_data *v;
-  struct timespec ts_temp;
+  struct timespec ts_temp, ts_fill;
   struct timespec ts;
+  int fills = 0;
+  struct labels *labels;
+  unsigned char *color;
+  int c;
   time_t now;
   char *str_now;
 
@@ -119,6 +121,11 @@ main (int argc, char *argv[])
   image->hole_retract = 3.0;	//for holes safe retract
   image->safe_traverse = 25.0;	//retract for safe move to PCB area (over wise etc..)
   image->route_optimize = 0;	//default no optimize router path
+  image->arc_tolerance = 0;	//default no arcs
+  image->expand_engine = 0;	//default byte mask copper expansion
+  image->rapid_engine = 0;	//default drake-hougardy rapid pairing
+  image->rapid_time = 1000;
+  image->threads = 1;
   image->drill_file = NULL;
   image->image_file = strdup ("pcb.pgm");
   image->output_file = NULL;
@@ -165,7 +172,7 @@ main (int argc, char *argv[])
       image->commandline[opt] = '.';
 
 
-  while ((opt = getopt (argc, argv, "+dbBo::ht:r:R:D:O:X:Y:e:c:H:")) != -1)
+  while ((opt = getopt (argc, argv, "+dbBo::ht:r:R:D:O:X:Y:e:c:H:E:j:P:T:a:")) != -1)
     {
       switch (opt)
 	{
@@ -176,6 +183,26 @@ main (int argc, char *argv[])
 	  if (image->hole_asymmetry < 0.05)
 	    image->hole_asymmetry = 0.16;
 	  break;
+	case 'E':
+	  image->expand_engine = atoi (optarg);
+	  if (image->expand_engine < 0 || image->expand_engine > 1)
+	    image->expand_engine = 0;
+	  break;
+	case 'j':
+	  image->threads = atoi (optarg);
+	  if (image->threads < 1)
+	    image->threads = 1;
+	  break;
+	case 'P':
+	  image->rapid_engine = atoi (optarg);
+	  if (image->rapid_engine < 0 || image->rapid_engine > 1)
+	    image->rapid_engine = 0;
+	  break;
+	case 'T':
+	  image->rapid_time = atoi (optarg);
+	  if (image->rapid_time < 0)
+	    image->rapid_time = 0;
+	  break;
 	case 'X':
 	  image->real_x = fabs (atof (optarg));
 	  break;
@@ -216,6 +243,9 @@ main (int argc, char *argv[])
 	  else
 	    image->route_optimize++;
 
+	  break;
+	case 'a':
+	  image->arc_tolerance = fabs (atof (optarg));
 	  break;
 	case 'O':
 	  image->output_file = strdup (optarg);
@@ -291,8 +321,19 @@ main (int argc, char *argv[])
 	  printf ("-O output G code file (default stderr)\n");
 	  printf
 	    ("-o optimization level, multile -o can be used or argument\n   can be used to set optimization level\n");
+	  printf
+	    ("-a arc fitting tolerance in mm, isolation lines are routed by\n   G2/G3 arcs where possible (default 0, no arcs)\n");
 	  printf
 	    ("-H defines hole asymmetry for automatic hole detection (5 to 20%%, default 16%%)\n");
+	  printf
+	    ("-E copper expansion engine, 0 byte masks (default), 1 bit packed\n");
+	  printf
+	    ("-j threads for region labelling, copper expansion and optimizer (default 1)\n");
+	  printf
+	    ("-P rapid pairing engine, 0 drake-hougardy (default), 1 greedy or\n   drake-hougardy (shorter one) + 2-opt, pairing length is never longer\n   than with 0, total rapid travel may be longer (components are joined\n   differently)\n");
+	  printf
+	    ("-T wall clock time limit for 2-opt in rapid pairing engine 1 in ms\n   (default %d), if limit is reached, result may differ between runs,\n   0 = no 2-opt\n",
+	     image->rapid_time);
 	  printf
 	    ("\nTOOL parameter definition: diameter(mm), radial speed (mm/min), axial speed(mm/min), rpm)\n");
 	  printf
@@ -338,16 +379,19 @@ main (int argc, char *argv[])
   if (input_img_read (image, 0))
     exit (1);
   image_crc (image);
+  i2real_init (image);
 
   create_border (image);
 
-  for (sy = 0; sy < image->y; sy++)
-    for (sx = 0; sx < image->x; sx++)
-
-      if (*(image->data + sx + image->x * sy) == 255)
-	{
-	  if (NULL != (v = image_fill (image, sx, sy, 100, 0)))
-	    {
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts_fill);
+  // label all regions, then classify regions on component table
+  labels = image_label (image);
+  color = malloc (labels->comps + 1);
+  for (c = 0; c < labels->comps; c++)
+    {
+      v = &labels->comp[c];
+      v->level = label_level (labels, c);
+      color[c] = 100;
 /*
 	      int dx, dy;
 	      double p1, p2, p3;
@@ -368,27 +412,35 @@ main (int argc, char *argv[])
 		      (v->ymax - v->ymin));
 */
 
-	      if (v->level == 1)
-		{
-		  if (fabs
-		      (1 -
-		       (double) (v->xmax - v->xmin) /
-		       (double) (v->ymax - v->ymin)) <
-		      image->hole_asymmetry && (v->xmax - v->xmin) > 1)
-		    {
-		      if (image->drill_file == NULL)
-			create_hole (image, v);
-		      image_fill (image, sx, sy, C_HOLE, 0);
-		    }
-
-		  else
-		    {
-		      if (image->auto_border)
-			image_fill (image, sx, sy, C_HOLE, 0);
-		    }
-		}
+      if (v->level == 1)
+	{
+	  if (fabs
+	      (1 -
+	       (double) (v->xmax - v->xmin) /
+	       (double) (v->ymax - v->ymin)) <
+	      image->hole_asymmetry && (v->xmax - v->xmin) > 1)
+	    {
+	      if (image->drill_file == NULL)
+		create_hole (image, v);
+	      color[c] = C_HOLE;
+	    }
+
+	  else
+	    {
+	      if (image->auto_border)
+		color[c] = C_HOLE;
 	    }
 	}
+    }
+  label_remap (labels, color);
+  fills = labels->comps;
+  free (color);
+  label_free (labels);
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts_temp);
+  ts_temp = tsx_diff (ts_fill, ts_temp);
+  printf ("image label %d regions, time %ld.%09ld, %.0f regions/s\n", fills,
+	  ts_temp.tv_sec, ts_temp.tv_nsec,
+	  fills / (ts_temp.tv_sec + ts_temp.tv_nsec / 1e9 + 1e-9));
   /* if already exist image for acceleration, use it */
   image_fast = calloc (1, sizeof (struct image));
   image_fast->image_file = strdup ("out.pgm");
@@ -413,7 +465,7 @@ main (int argc, char *argv[])
 	}
       free (image_fast->comment);
       free (image_fast->mtime);
-      free (image_fast->data_orig);
+      input_img_free_orig (image_fast);
     }
   else
     {
@@ -495,10 +547,9 @@ main (int argc, char *argv[])
   printf ("proces run time %ld.%09ld\n", ts_temp.tv_sec, ts_temp.tv_nsec);
   postprocesor_close ();
 
-  free (image->mask_data);
   free (image->or_mask);
   free (image->data);
-  free (image->data_orig);
+  input_img_free_orig (image);
   if (image->comment)
     free (image->comment);
   if (image->drill_file)
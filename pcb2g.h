@@ -43,12 +43,13 @@ struct image
 {
   unsigned char *data;
   unsigned char *data_orig;
-  unsigned char *mask_data;
   unsigned char *or_mask;
   int size;			//x*(y-2)
   int x, y;
   int dpi;
   double real_x, real_y;	//real X and Y dimension
+  double mm_mul_x, mm_mul_y;	//pixel to mm transform (i2real_init())
+  double mm_div_x, mm_div_y, mm_div;
   char crc[5];			//16bit crc in ascii + terminating '\0'
   char *drill_file;
   char *image_file;
@@ -57,6 +58,11 @@ struct image
   int route_border;		//route board border
   int auto_border;		//border for non retrangular PCB
   int route_optimize;		//switch for  routes optimization
+  double arc_tolerance;		//arc fitting tolerance (mm), 0 = no arcs
+  int expand_engine;		//copper expansion 0 = byte masks, 1 = bit packed
+  int threads;			//threads for labelling, expansion and optimizer
+  int rapid_engine;		//rapid pairing 0 = drake-hougardy, 1 = greedy + 2-opt
+  int rapid_time;		//time budget for rapid pairing engine 1 (ms)
   double safe_traverse;		//safe traverse over wise etc.. default 10mm
   double route_retract;		//default 2
   double hole_retract;		//default 5
@@ -83,6 +89,7 @@ struct image
   struct hole *first_hole;
   struct polyline *first_polyline;
   struct multigraph *first_mg;
+  struct arena *arena;		//polyline/tree/m_point allocator
 
 /* statistical */
   double hole_line_min;		//minimal distance hole to division line in real units
@@ -121,6 +128,7 @@ struct hole
 //specify flag M_GRAY to not convert gray image to bw image
 #define M_GRAY 1
 int input_img_read (struct image *image,int flags);
+void input_img_free_orig (struct image *image);
 
 void create_border (struct image *image);
 int img_write (struct image *image, char *name, char *comment);
@@ -136,8 +144,43 @@ struct fill_data
   int level;
 };
 
-struct fill_data *image_fill (struct image *image, int vx, int vy,
-			      unsigned char fill_data, unsigned char border);
+
+// connected component labelling (label.c)
+struct label_run
+{
+  int x0, x1, y;
+};
+
+struct labels
+{
+  struct image *image;
+  struct label_run *run;	// runs in raster order
+  int runs;
+  int *row_first;		// first run in row y, row_first[image->y] = runs
+  int *parent;			// union find
+  int *label;			// component number of run
+  struct fill_data *comp;	// components in order of first pixel
+  int *first;			// first run of component
+  int comps;
+  char *filled;			// label_level() work space
+  int *stack;
+  int stack_size;
+};
+
+struct labels *image_label (struct image *image);
+int label_level (struct labels *l, int c);
+void label_remap (struct labels *l, unsigned char *color);
+void label_free (struct labels *l);
+
+// small object allocator (arena.c), object types
+#define ARENA_POINT 0
+#define ARENA_POLYLINE 1
+#define ARENA_TREE 2
+#define ARENA_M_POINT 3
+#define ARENA_TYPES 4
+void *arena_alloc (struct image *image, int type, size_t size);
+void arena_free (struct image *image, int type, void *p);
+void arena_release (struct image *image);
 
 #define C_HOLE 5
 #define C_HOLE_ALIGNED 6
@@ -145,12 +188,57 @@ struct fill_data *image_fill (struct image *image, int vx, int vy,
 #define C_COPPER 64
 
 
+unsigned char get_mask (struct image *image, int i, int border);
+void mask_plane (struct image *image, unsigned char *mask, int border);
+void mask_range (struct image *image, unsigned char *mask, int from, int to,
+		 int border);
+void mask_update (struct image *image, unsigned char *mask, int p, int set);
+
 void recolor (struct image *image, int fill_color, int level);
+void recolor_map_init (unsigned char *map);
+void recolor_map_add (unsigned char *map, int fill_color, int level);
+void recolor_map (struct image *image, unsigned char *map);
 int expand_copper (struct image *image);
+void bit_e64 (struct image *image);
+
+//expansion rules, bit in expand_rule[mask]
+#define R_4TO8      0x01
+#define R_DIAG      0x02
+#define R_DIAG_FILL 0x04
+#define R_UP        0x08
+#define R_DOWN      0x10
+#define R_LEFT      0x20
+#define R_RIGHT     0x40
+#define R_ROZOK     0x80
+//noexpand rules, expand_noexpand[mask] = next index after fill
+#define NE_UP   1		// i - x
+#define NE_DOWN 2		// i + x
+#define NE_LEFT 3		// i - 1
+#define NE_SKIP 4		// i + 2
+#define NE_NEXT 5		// i + 1
+extern unsigned char expand_rule[256];
+extern unsigned char expand_noexpand[256];
+void expand_rules_init (void);
+
 
+/*
+  pixel to mm conversion, transform is precomputed by i2real_init().
+  Division is not replaced by multiplication with reciprocal value, this
+  rounds differently and printed coordinates may change in last digit.
+*/
+void i2real_init (struct image *image);
 
-double i2realX (struct image *image, int x);
-double i2realY (struct image *image, int y);
+static inline double
+i2realX (struct image *image, int x)
+{
+  return (double) x *image->mm_mul_x / image->mm_div_x / image->mm_div;
+}
+
+static inline double
+i2realY (struct image *image, int y)
+{
+  return (double) y *image->mm_mul_y / image->mm_div_y / image->mm_div;
+}
 
 int trace (struct image *image);
 
@@ -168,4 +256,5 @@ extern int debug_level;
 #define VOPT 1
 
 void optim (struct image *image);
+void arc_fit (struct image *image);
 void create_cut (char *filename);
@@ -55,7 +55,7 @@ polylines_dump (struct image *image)
    */
 
 static void
-polyline_remove_all_points (struct polyline *p)
+polyline_remove_all_points (struct image *image, struct polyline *p)
 {
   struct polyline_point *p_old, *p_point = p->points;
 
@@ -63,7 +63,7 @@ polyline_remove_all_points (struct polyline *p)
     {
       p_old = p_point;
       p_point = p_point->next;
-      free (p_old);
+      arena_free (image, ARENA_POINT, p_old);
     }
 }
 
@@ -74,20 +74,20 @@ polyline_remove_all_points (struct polyline *p)
    */
 
 static void
-free_polyline_tree (struct polyline_tree *t)
+free_polyline_tree (struct image *image, struct polyline_tree *t)
 {
   if (!t)
     return;
 
   if (t->left)
     {
-      free_polyline_tree (t->left);
-      free (t->left);
+      free_polyline_tree (image, t->left);
+      arena_free (image, ARENA_TREE, t->left);
     }
   if (t->right)
     {
-      free_polyline_tree (t->right);
-      free (t->right);
+      free_polyline_tree (image, t->right);
+      arena_free (image, ARENA_TREE, t->right);
     }
 }
 
@@ -105,13 +105,13 @@ polyline_delete_default (struct image *image)
   if (!image->first_polyline)
     return;
 
-  polyline_remove_all_points (image->first_polyline);
+  polyline_remove_all_points (image, image->first_polyline);
   if (image->first_polyline->tree)
-    free_polyline_tree (image->first_polyline->tree);
+    free_polyline_tree (image, image->first_polyline->tree);
 
 
   p_line = image->first_polyline->next;
-  free (image->first_polyline);
+  arena_free (image, ARENA_POLYLINE, image->first_polyline);
   image->first_polyline = p_line;
 }
 
@@ -178,7 +178,8 @@ polyline_find_append (struct image *image, int x, int y, int rx, int ry)
   p_point = polyline_search_at_start (image, x, y);
   if (p_point)
     {
-      a_point = calloc (sizeof (struct polyline_point), 1);
+      a_point =
+	arena_alloc (image, ARENA_POINT, sizeof (struct polyline_point));
       a_point->head = p_point->head;
       a_point->x = rx;
       a_point->y = ry;
@@ -200,7 +201,8 @@ polyline_append (struct image *image, int x, int y)
   struct polyline_point *p_point;
 
   DPRINT ("appending to %d %d\n", x, y);
-  p_point = calloc (sizeof (struct polyline_point), 1);
+  p_point =
+    arena_alloc (image, ARENA_POINT, sizeof (struct polyline_point));
   p_point->head = image->first_polyline;
   p_point->x = x;
   p_point->y = y;
@@ -254,7 +256,7 @@ polyline_start (struct image *image, int x, int y)
   struct polyline *p_line;
 
   DPRINT ("starting polyline %d %d\n", x, y);
-  p_line = calloc (sizeof (struct polyline), 1);
+  p_line = arena_alloc (image, ARENA_POLYLINE, sizeof (struct polyline));
   p_line->next = image->first_polyline;
   p_line->end_x = x;
   p_line->end_y = y;
@@ -266,11 +268,27 @@ polyline_start (struct image *image, int x, int y)
 void
 polyline_reverse (struct polyline *ps)
 {
-  struct polyline_point *tmp_point, *rest_points;
+  struct polyline_point *tmp_point, *rest_points, *p;
+  double cx = 0, cy = 0, tmp_cx, tmp_cy;
+  int arc = 0, tmp_arc;
 
   ps->end_x = ps->points->x;
   ps->end_y = ps->points->y;
 
+  // arc is stored in first point of segment, move it to next point
+  for (p = ps->points; p != NULL; p = p->next)
+    {
+      tmp_arc = p->arc;
+      tmp_cx = p->arc_cx;
+      tmp_cy = p->arc_cy;
+      p->arc = -arc;
+      p->arc_cx = cx;
+      p->arc_cy = cy;
+      arc = tmp_arc;
+      cx = tmp_cx;
+      cy = tmp_cy;
+    }
+
   rest_points = ps->points;
   ps->points = NULL;
 
@@ -284,20 +302,12 @@ polyline_reverse (struct polyline *ps)
 }
 
 
+// all polylines, points and trees are in image arena, release it at once
 void
 polyline_free_all (struct image *image)
 {
-  struct polyline *p, *p_old;
-
-  for (p = image->first_polyline; p != NULL;)
-    {
-      polyline_remove_all_points (p);
-      free_polyline_tree (p->tree);
-      free (p->tree);
-      p_old = p->next;
-      free (p);
-      p = p_old;
-    }
+  image->first_polyline = NULL;
+  arena_release (image);
 }
 
 static void
@@ -309,10 +319,10 @@ polyline_delete (struct image *image, struct polyline *p_del)
     {
       if ((*p) == p_del)
 	{
-	  polyline_remove_all_points (p_del);
-	  free_polyline_tree (p_del->tree);
+	  polyline_remove_all_points (image, p_del);
+	  free_polyline_tree (image, p_del->tree);
 	  (*p) = p_del->next;
-	  free (p_del);
+	  arena_free (image, ARENA_POLYLINE, p_del);
 	  return;
 	}
     }
@@ -42,6 +42,9 @@ struct polyline_point
 {
   int x, y;
   int flag;			//if not 0, do not append to this point
+  int index;			//position in optimizer arrays (optim.c)
+  int arc;			//segment to next point is arc, 1 = G3, -1 = G2 (arc.c)
+  double arc_cx, arc_cy;	//arc center (real units)
   struct polyline_point *next;
   struct polyline *head;
   double mindistance;		//minimum distance from this line to other points
@@ -59,6 +62,7 @@ struct polyline
   struct polyline_tree *tree;
 
   int optimized_count;		//for optimization
+  int index;			//polyline number in optimizer arrays (optim.c)
 };
 
 struct polyline_tree
@@ -81,6 +85,7 @@ struct polyline_tree
   struct polyline_tree *right;
 
   int level;			//recursion level
+  int id;			//tree number for check_line() cache (optim.c)
 };
 
 void create_line (struct image *image, int x1, int y1, int x2, int y2);
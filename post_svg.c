@@ -253,7 +253,7 @@ svg_route_arc (struct postprocesor *p, double x, double y, double cx,
   if (!DATA (p)->fd)
     return;
 
-  dir = dir ? 1 : 0;
+  dir = dir < 0 ? 0 : 1;		// same as linuxcnc, -1 = G2
   //calculate if center is on left or right side of line start-end
   dist =
     lineToPointSDistance2D (DATA (p)->last_x, DATA (p)->last_y, x, y, cx, cy);
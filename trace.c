@@ -57,35 +57,10 @@ struct m_point
 
 static int artefact (struct image *image);
 
-/* tracing fcions */
-
-// TODO this is duplicity with code in expand.c
-static unsigned char
-get_mask (struct image *image, int i, int border)
-{
-  unsigned char mask = 0;
-
-  if (*(image->data + i) <= border)
-    mask |= 1 << 3;
-  if (*(image->data + i + 1) <= border)
-    mask |= 1 << 2;
-  if (*(image->data + i + 2) <= border)
-    mask |= 1 << 1;
-  if (*(image->data + i + 2 + image->x) <= border)
-    mask |= 1 << 0;
-  if (*(image->data + i + image->x) <= border)
-    mask |= 1 << 4;
-  if (*(image->data + i + image->x + image->x) <= border)
-    mask |= 1 << 5;
-  if (*(image->data + i + 1 + image->x + image->x) <= border)
-    mask |= 1 << 6;
-  if (*(image->data + i + 2 + image->x + image->x) <= border)
-    mask |= 1 << 7;
-  return mask;
-}
-
-// TODO end this is duplicity with code in expand.c
+// masks (border 128) for whole image, updated if pixel is traced
+static unsigned char *trace_masks;
 
+/* tracing fcions */
 
 static int
 bit_2_data (unsigned char mask, int *x, int *y)
@@ -171,6 +146,9 @@ next_pixel (struct image *image, int x, int y, int dx, int dy,
 
 //mark this pixel as traced
   *(image->data + nx + ny * image->x) = C_TRACED_POINT;
+  if (trace_masks)
+    mask_update (image, trace_masks, nx + ny * image->x,
+		 C_TRACED_POINT <= 128);
 
 // save line from previous point to curent point
   polyline_extend (image, nx * 2, ny * 2);
@@ -283,10 +261,10 @@ trace_m_point (struct image *image, struct m_point *m_point)
 }
 
 struct m_point *
-m_point_new (int x, int y, unsigned char mask)
+m_point_new (struct image *image, int x, int y, unsigned char mask)
 {
   struct m_point *new_m_point;
-  new_m_point = calloc (sizeof (struct m_point), 1);
+  new_m_point = arena_alloc (image, ARENA_M_POINT, sizeof (struct m_point));
   new_m_point->next = first_m_point;
   new_m_point->x = x;
   new_m_point->y = y;
@@ -304,18 +282,21 @@ trace (struct image *image)
   unsigned char mask;
   struct m_point *new_m_point;
 
+  trace_masks = malloc (sizeof (unsigned char) * image->x * image->y);
+  mask_plane (image, trace_masks, 128);
+
   for (y = 2; y < image->y - 2; y++)
     for (x = 2; x < image->x - 2; x++)
       if (*(image->data + x + y * image->x) == 0)
 	{
-	  mask = get_mask (image, x - 1 + (y - 1) * image->x, 128);
+	  mask = trace_masks[x - 1 + (y - 1) * image->x];
 
 	  if (mask_test (mask) > 2)
 	    {
 
 	      DPRINT ("saving m_point %d %d for mask 0x%02x - %d dirs\n",
 		      x, y, mask, mask_test (mask));
-	      m_point_new (x, y, mask);
+	      m_point_new (image, x, y, mask);
 	      *(image->data + x + y * image->x) = C_M_POINT;	//mark m_point
 	    }
 	}
@@ -339,13 +320,13 @@ trace (struct image *image)
 	for (x = 2; x < image->x - 2; x++)
 	  if (*(image->data + x + y * image->x) == 0)
 	    {
-	      mask = get_mask (image, x - 1 + (y - 1) * image->x, 128);
+	      mask = trace_masks[x - 1 + (y - 1) * image->x];
 	      if (mask_test (mask) == 2)
 		{
 		  DPRINT ("saving m_point %d %d for mask 0x%02x - 2 dirs\n",
 			  x, y, mask);
 		  *(image->data + x + y * image->x) = C_M_POINT;	//mark m_point
-		  trace_m_point (image, m_point_new (x, y, mask));
+		  trace_m_point (image, m_point_new (image, x, y, mask));
 		  flag = 1;
 		}
 	    }
@@ -356,17 +337,20 @@ trace (struct image *image)
     for (x = 2; x < image->x - 2; x++)
       if (*(image->data + x + y * image->x) == 0)
 	{
-	  mask = get_mask (image, x - 1 + (y - 1) * image->x, 128);
+	  mask = trace_masks[x - 1 + (y - 1) * image->x];
 	  if (mask_test (mask))
 	    printf ("Warning, pixel at end of line at %d %d\n", x, y);
 	  else
 	    printf ("Warning, isolated pixel at %d %d\n", x, y);
 	}
 
+  free (trace_masks);
+  trace_masks = NULL;
+
   while (first_m_point)
     {
       new_m_point = first_m_point->next;
-      free (first_m_point);
+      arena_free (image, ARENA_M_POINT, first_m_point);
       first_m_point = new_m_point;
     }
 
@@ -392,43 +376,51 @@ artefact (struct image *image)
 
   int x, y;
   unsigned char mask;
+  unsigned char *masks;
 //  struct m_point *new_m_point;
 
-  for (y = 2; y < image->y - 2; y++)
-    for (x = 2; x < image->x - 2; x++)
-      if (*(image->data + x + y * image->x) != 0)
-	{
-	  mask =
-	    get_mask (image, x - 1 + (y - 1) * image->x, C_TRACED_POINT + 1);
-	  if (mask == 0xf8 || mask == 0xFA)
-	    {
-	      DPRINT ("F8 at %d %d  %d %d\n", 2 * (x - 1), 2 * y, 2 * x,
-		      2 * (y + 1));
-	      polyline_delete_m_line (image, 2 * (x - 1), 2 * y, 2 * x,
-				      2 * (y + 1));
-	    }
-	  if (mask == 0x3e || mask == 0xbe)
-	    {
-	      DPRINT ("3E at %d %d  %d %d\n", 2 * (x - 1), 2 * y, 2 * x,
-		      2 * (y - 1));
-	      polyline_delete_m_line (image, 2 * (x - 1), 2 * y, 2 * x,
-				      2 * (y - 1));
-	    }
-	  if (mask == 0x8f || mask == 0xAF)
-	    {
-	      DPRINT ("8F at %d %d  %d %d\n", 2 * (x + 1), 2 * y, 2 * x,
-		      2 * (y - 1));
-	      polyline_delete_m_line (image, 2 * (x + 1), 2 * y, 2 * x,
-				      2 * (y - 1));
-	    }
-	  if (mask == 0xe3 || mask == 0xeb)
-	    {
-	      DPRINT ("E3 at %d %d  %d %d\n", 2 * (x + 1), 2 * y, 2 * x,
-		      2 * (y + 1));
-	      polyline_delete_m_line (image, 2 * (x + 1), 2 * y, 2 * x,
-				      2 * (y + 1));
+  // masks for one row only
+  masks = malloc (sizeof (unsigned char) * image->x);
 
-	    }
-	}
+  for (y = 2; y < image->y - 2; y++)
+    {
+      mask_range (image, masks, (y - 1) * image->x, y * image->x,
+		  C_TRACED_POINT + 1);
+      for (x = 2; x < image->x - 2; x++)
+	if (*(image->data + x + y * image->x) != 0)
+	  {
+	    mask = masks[x - 1];
+	    if (mask == 0xf8 || mask == 0xFA)
+	      {
+		DPRINT ("F8 at %d %d  %d %d\n", 2 * (x - 1), 2 * y, 2 * x,
+			2 * (y + 1));
+		polyline_delete_m_line (image, 2 * (x - 1), 2 * y, 2 * x,
+					2 * (y + 1));
+	      }
+	    if (mask == 0x3e || mask == 0xbe)
+	      {
+		DPRINT ("3E at %d %d  %d %d\n", 2 * (x - 1), 2 * y, 2 * x,
+			2 * (y - 1));
+		polyline_delete_m_line (image, 2 * (x - 1), 2 * y, 2 * x,
+					2 * (y - 1));
+	      }
+	    if (mask == 0x8f || mask == 0xAF)
+	      {
+		DPRINT ("8F at %d %d  %d %d\n", 2 * (x + 1), 2 * y, 2 * x,
+			2 * (y - 1));
+		polyline_delete_m_line (image, 2 * (x + 1), 2 * y, 2 * x,
+					2 * (y - 1));
+	      }
+	    if (mask == 0xe3 || mask == 0xeb)
+	      {
+		DPRINT ("E3 at %d %d  %d %d\n", 2 * (x + 1), 2 * y, 2 * x,
+			2 * (y + 1));
+		polyline_delete_m_line (image, 2 * (x + 1), 2 * y, 2 * x,
+					2 * (y + 1));
+
+	      }
+	  }
+    }
+  free (masks);
   return 0;
 }
@@ -23,9 +23,11 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <float.h>
 #include <limits.h>
+#include <time.h>
 #include "pcb2g.h"
 #include "tsp.h"
 #include "pgeom.h"
@@ -40,12 +42,55 @@
 #define  DPRINT(msg...)
 #endif
 
+/*
+  graph nodes are indexed by open addressing hash table (linear probing),
+  key is node position (doubled pixel coordinates)
+*/
+static struct multigraph **mg_hash;
+static unsigned int mg_hash_size;	// power of 2
+static unsigned int mg_hash_count;
+
+static unsigned int
+mg_hash_key (int x, int y)
+{
+  return ((unsigned int) x * 0x9e3779b1u) ^ ((unsigned int) y * 0x85ebca77u);
+}
+
+static void
+mg_hash_insert (struct multigraph *mg)
+{
+  unsigned int i;
+  struct multigraph **old;
+  unsigned int old_size;
+
+  if (2 * (mg_hash_count + 1) > mg_hash_size)
+    {
+      old = mg_hash;
+      old_size = mg_hash_size;
+      mg_hash_size = mg_hash_size ? mg_hash_size * 2 : 1024;
+      mg_hash = calloc (mg_hash_size, sizeof (struct multigraph *));
+      mg_hash_count = 0;
+      for (i = 0; i < old_size; i++)
+	if (old[i])
+	  mg_hash_insert (old[i]);
+      free (old);
+    }
+  for (i = mg_hash_key (mg->x, mg->y) & (mg_hash_size - 1); mg_hash[i];
+       i = (i + 1) & (mg_hash_size - 1));
+  mg_hash[i] = mg;
+  mg_hash_count++;
+}
+
 static struct multigraph *
 search_mg (struct image *image, int x, int y)
 {
   struct multigraph *mg;
+  unsigned int i;
 
-  for (mg = image->first_mg; mg != NULL; mg = mg->next)
+  if (!mg_hash)
+    return NULL;
+  for (i = mg_hash_key (x, y) & (mg_hash_size - 1); (mg = mg_hash[i]);
+       i = (i + 1) & (mg_hash_size - 1))
     if (mg->x == x && mg->y == y)
       return mg;
   return NULL;
@@ -73,6 +118,199 @@ Return L or R, whichever has the greater total weight.
 next code is for full graph:
 */
 
+/*
+  uniform grid over odd nodes for nearest unpaired node search, nodes are
+  removed from grid when paired. Grid is rebuilt (with bigger cells) if
+  most of nodes are removed. order (position in node list) is used to
+  select same node as full scan of list for equal distances.
+*/
+struct dh_grid
+{
+  double x0, y0, cell;
+  int nx, ny;
+  int *start;			// first node in cell
+  int *cnt;			// live nodes in cell
+  struct multigraph **node;
+  int *order;
+  int live, built;
+};
+
+static int
+dh_cell (struct dh_grid *g, double x, double y)
+{
+  int cx = (x - g->x0) / g->cell;
+  int cy = (y - g->y0) / g->cell;
+
+  if (cx < 0)
+    cx = 0;
+  if (cx >= g->nx)
+    cx = g->nx - 1;
+  if (cy < 0)
+    cy = 0;
+  if (cy >= g->ny)
+    cy = g->ny - 1;
+  return cx + cy * g->nx;
+}
+
+// (re)build grid from n nodes
+static void
+dh_grid_build (struct dh_grid *g, struct multigraph **node, int *order, int n)
+{
+  double x1, y1, w, h;
+  int i, c, *pos;
+  struct multigraph **new_node;
+  int *new_order;
+
+  g->x0 = x1 = node[0]->rx;
+  g->y0 = y1 = node[0]->ry;
+  for (i = 1; i < n; i++)
+    {
+      if (g->x0 > node[i]->rx)
+	g->x0 = node[i]->rx;
+      if (x1 < node[i]->rx)
+	x1 = node[i]->rx;
+      if (g->y0 > node[i]->ry)
+	g->y0 = node[i]->ry;
+      if (y1 < node[i]->ry)
+	y1 = node[i]->ry;
+    }
+  w = x1 - g->x0;
+  h = y1 - g->y0;
+  // about two nodes in one cell
+  g->cell = sqrt (2.0 * w * h / n);
+  if (g->cell < (w > h ? w : h) / (2.0 * n))
+    g->cell = (w > h ? w : h) / (2.0 * n);
+  if (g->cell <= 0)
+    g->cell = 1;
+  g->nx = w / g->cell + 1;
+  g->ny = h / g->cell + 1;
+
+  free (g->start);
+  free (g->cnt);
+  g->start = calloc (g->nx * g->ny + 1, sizeof (int));
+  g->cnt = calloc (g->nx * g->ny, sizeof (int));
+  for (i = 0; i < n; i++)
+    g->cnt[dh_cell (g, node[i]->rx, node[i]->ry)]++;
+  for (c = 0; c < g->nx * g->ny; c++)
+    g->start[c + 1] = g->start[c] + g->cnt[c];
+
+  pos = malloc (g->nx * g->ny * sizeof (int));
+  for (c = 0; c < g->nx * g->ny; c++)
+    pos[c] = g->start[c];
+  new_node = malloc (n * sizeof (struct multigraph *));
+  new_order = malloc (n * sizeof (int));
+  for (i = 0; i < n; i++)
+    {
+      c = dh_cell (g, node[i]->rx, node[i]->ry);
+      new_node[pos[c]] = node[i];
+      new_order[pos[c]++] = order[i];
+    }
+  free (pos);
+  free (g->node);
+  free (g->order);
+  g->node = new_node;
+  g->order = new_order;
+  g->live = g->built = n;
+}
+
+static void
+dh_grid_free (struct dh_grid *g)
+{
+  free (g->start);
+  free (g->cnt);
+  free (g->node);
+  free (g->order);
+}
+
+// compact live nodes and build grid with bigger cells if most nodes are removed
+static void
+dh_grid_compact (struct dh_grid *g)
+{
+  int k, c, i;
+  struct multigraph **node;
+  int *order;
+
+  if (g->live <= 64 || g->live * 4 >= g->built)
+    return;
+  node = malloc (g->live * sizeof (struct multigraph *));
+  order = malloc (g->live * sizeof (int));
+  for (k = 0, c = 0; c < g->nx * g->ny; c++)
+    for (i = g->start[c]; i < g->start[c] + g->cnt[c]; i++)
+      {
+	node[k] = g->node[i];
+	order[k++] = g->order[i];
+      }
+  dh_grid_build (g, node, order, k);
+  free (node);
+  free (order);
+}
+
+static void
+dh_grid_remove (struct dh_grid *g, struct multigraph *mg)
+{
+  int c = dh_cell (g, mg->rx, mg->ry);
+  int k, last;
+
+  for (k = g->start[c]; k < g->start[c] + g->cnt[c]; k++)
+    if (g->node[k] == mg)
+      break;
+  last = g->start[c] + --g->cnt[c];
+  g->node[k] = g->node[last];
+  g->order[k] = g->order[last];
+  g->live--;
+  dh_grid_compact (g);
+}
+
+// nearest node in grid, same distance and tie as full scan of node list
+static struct multigraph *
+dh_grid_nearest (struct dh_grid *g, struct multigraph *mg1, double *min)
+{
+  struct multigraph *mg2, *mg_min = NULL;
+  int min_order = INT_MAX;
+  int c, cx, cy, r, x, y, k;
+  double len;
+
+  *min = DBL_MAX;
+  c = dh_cell (g, mg1->rx, mg1->ry);
+  cx = c % g->nx;
+  cy = c / g->nx;
+  for (r = 0; r < g->nx || r < g->ny; r++)
+    {
+      for (y = cy - r; y <= cy + r; y++)
+	{
+	  if (y < 0 || y >= g->ny)
+	    continue;
+	  for (x = cx - r; x <= cx + r;
+	       x += (y == cy - r || y == cy + r) ? 1 : 2 * r)
+	    {
+	      if (x >= 0 && x < g->nx)
+		{
+		  c = x + y * g->nx;
+		  for (k = g->start[c]; k < g->start[c] + g->cnt[c]; k++)
+		    {
+		      mg2 = g->node[k];
+		      len = (mg1->rx - mg2->rx) * (mg1->rx - mg2->rx);
+		      len += (mg1->ry - mg2->ry) * (mg1->ry - mg2->ry);
+		      len = sqrt (len);
+		      if (len < *min || (len == *min && g->order[k] < min_order))
+			{
+			  mg_min = mg2;
+			  *min = len;
+			  min_order = g->order[k];
+			}
+		    }
+		}
+	      if (r == 0)
+		break;
+	    }
+	}
+      // nodes in next ring are at least r cells away
+      if (mg_min && *min < r * g->cell * (1 - 1e-9))
+	break;
+    }
+  return mg_min;
+}
+
 static double
 drake_hougardy (struct image *image, int count)
 {
@@ -80,9 +318,11 @@ drake_hougardy (struct image *image, int count)
   struct multigraph **L[2];
   int index[2];
   double s_len[2];
-  struct multigraph *mg1, *mg2, *mg_min;
+  struct multigraph *mg1, *mg_min;
+  struct multigraph **odd;
+  struct dh_grid grid = { 0 };
+  int *order, n;
   double min;
-  double len;
   int alternate = 0;
 
   if (!image->first_mg)
@@ -101,6 +341,21 @@ drake_hougardy (struct image *image, int count)
   index[0] = index[1] = 0;
   s_len[0] = s_len[1] = 0;
 
+  // grid of nodes with odd edges
+  odd = malloc (count * sizeof (struct multigraph *));
+  order = malloc (count * sizeof (int));
+  for (n = 0, mg1 = image->first_mg; mg1 != NULL; mg1 = mg1->next)
+    if (mg1->count & 1)
+      {
+	odd[n] = mg1;
+	order[n] = n;
+	n++;
+      }
+  if (n)
+    dh_grid_build (&grid, odd, order, n);
+  free (odd);
+  free (order);
+
   for (mg1 = image->first_mg;;)
     {
       // exclude nodes with even edges
@@ -109,26 +364,8 @@ drake_hougardy (struct image *image, int count)
 	  mg1 = mg1->next;
 	  continue;
 	}
-      min = DBL_MAX;
-      mg_min = NULL;
-      for (mg2 = image->first_mg; mg2 != NULL; mg2 = mg2->next)
-	{
-	  // exclude nodes with even edges
-	  if ((mg2->count & 1) == 0)
-	    continue;
-	  if (mg1 == mg2)
-	    continue;
-	  if (mg2->dh)
-	    continue;
-	  len = (mg1->rx - mg2->rx) * (mg1->rx - mg2->rx);
-	  len += (mg1->ry - mg2->ry) * (mg1->ry - mg2->ry);
-	  len = sqrt (len);
-	  if (len < min)
-	    {
-	      mg_min = mg2;
-	      min = len;
-	    }
-	}
+      dh_grid_remove (&grid, mg1);
+      mg_min = dh_grid_nearest (&grid, mg1, &min);
       if (mg_min == NULL)
 	{
 	  if (alternate)
@@ -156,6 +393,7 @@ drake_hougardy (struct image *image, int count)
       mg1->dh = 1;
       mg1 = mg_min;
     }
+  dh_grid_free (&grid);
 
   for (mg1 = image->first_mg; mg1 != NULL; mg1 = mg1->next)
     // exclude nodes with even edges
@@ -194,6 +432,283 @@ drake_hougardy (struct image *image, int count)
   return s_len[1];
 }
 
+#define RAPID_KNN 8
+
+// k nearest nodes in grid (indexes in order[]), sorted by distance
+static int
+dh_grid_knn (struct dh_grid *g, struct multigraph *mg1, int k, int *idx,
+	     double *dist)
+{
+  struct multigraph *mg2;
+  int c, cx, cy, r, x, y, i, j, n = 0;
+  double len;
+
+  c = dh_cell (g, mg1->rx, mg1->ry);
+  cx = c % g->nx;
+  cy = c / g->nx;
+  for (r = 0; r < g->nx || r < g->ny; r++)
+    {
+      for (y = cy - r; y <= cy + r; y++)
+	{
+	  if (y < 0 || y >= g->ny)
+	    continue;
+	  for (x = cx - r; x <= cx + r;
+	       x += (y == cy - r || y == cy + r) ? 1 : 2 * r)
+	    {
+	      if (x >= 0 && x < g->nx)
+		{
+		  c = x + y * g->nx;
+		  for (i = g->start[c]; i < g->start[c] + g->cnt[c]; i++)
+		    {
+		      mg2 = g->node[i];
+		      if (mg2 == mg1)
+			continue;
+		      len = (mg1->rx - mg2->rx) * (mg1->rx - mg2->rx);
+		      len += (mg1->ry - mg2->ry) * (mg1->ry - mg2->ry);
+		      len = sqrt (len);
+		      if (n == k && len >= dist[k - 1])
+			continue;
+		      // insert sorted
+		      for (j = n < k ? n++ : k - 1; j > 0 && dist[j - 1] > len;
+			   j--)
+			{
+			  dist[j] = dist[j - 1];
+			  idx[j] = idx[j - 1];
+			}
+		      dist[j] = len;
+		      idx[j] = g->order[i];
+		    }
+		}
+	      if (r == 0)
+		break;
+	    }
+	}
+      if (n == k && dist[k - 1] < r * g->cell * (1 - 1e-9))
+	break;
+    }
+  return n;
+}
+
+struct rapid_edge
+{
+  double len;
+  int a, b;
+};
+
+static int
+rapid_edge_cmp (const void *p1, const void *p2)
+{
+  const struct rapid_edge *e1 = p1, *e2 = p2;
+
+  if (e1->len != e2->len)
+    return e1->len < e2->len ? -1 : 1;
+  if (e1->a != e2->a)
+    return e1->a - e2->a;
+  return e1->b - e2->b;
+}
+
+static double
+rapid_len (struct multigraph *mg1, struct multigraph *mg2)
+{
+  return sqrt ((mg1->rx - mg2->rx) * (mg1->rx - mg2->rx) +
+	       (mg1->ry - mg2->ry) * (mg1->ry - mg2->ry));
+}
+
+static double
+rapid_sum (struct multigraph **odd, int *mate, int n)
+{
+  double sum = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (mate[i] > i)
+      sum += rapid_len (odd[i], odd[mate[i]]);
+  return sum;
+}
+
+/*
+ rapid pairing engine 1:
+ greedy matching over edges of k nearest neighbour graph (shortest edge
+ first), nodes not paired by kNN edges are paired by nearest neighbour
+ chain. Shorter of greedy and drake-hougardy matching is then improved
+ by 2-opt swaps (a-b, c-d -> a-c, b-d) for c in kNN of a until no swap
+ is found or time budget is exhausted (pairing length is never longer
+ than drake-hougardy, total rapid travel may be, result depends on
+ machine speed if budget is exhausted).
+*/
+static double
+rapid_greedy (struct image *image, int count)
+{
+  struct multigraph **odd, *mg;
+  struct dh_grid grid = { 0 };
+  struct rapid_edge *e;
+  struct timespec ts_start, ts;
+  double *dist, len, greedy, dh, sum;
+  int *mate, *dh_mate, *nb, *nbc, *order;
+  int n, i, j, k, a, b, c, d, edges, swaps = 0, passes = 0, flag;
+  long ms;
+
+  odd = malloc (count * sizeof (struct multigraph *));
+  for (n = 0, mg = image->first_mg; mg != NULL; mg = mg->next)
+    if (mg->count & 1)
+      odd[n++] = mg;
+  if (n < 2)
+    {
+      free (odd);
+      printf ("rapid pairing: no rapids to add\n");
+      return 0;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &ts_start);
+
+  order = malloc (n * sizeof (int));
+  mate = malloc (n * sizeof (int));
+  dh_mate = malloc (n * sizeof (int));
+  nb = malloc (n * RAPID_KNN * sizeof (int));
+  nbc = malloc (n * sizeof (int));
+  dist = malloc (RAPID_KNN * sizeof (double));
+  e = malloc (n * RAPID_KNN * sizeof (struct rapid_edge));
+  for (i = 0; i < n; i++)
+    {
+      order[i] = i;
+      mate[i] = -1;
+    }
+
+  // kNN graph
+  dh_grid_build (&grid, odd, order, n);
+  for (edges = 0, i = 0; i < n; i++)
+    {
+      nbc[i] = dh_grid_knn (&grid, odd[i], RAPID_KNN, nb + i * RAPID_KNN,
+			    dist);
+      for (k = 0; k < nbc[i]; k++)
+	{
+	  j = nb[i * RAPID_KNN + k];
+	  e[edges].len = dist[k];
+	  e[edges].a = i < j ? i : j;
+	  e[edges].b = i < j ? j : i;
+	  edges++;
+	}
+    }
+
+  // greedy matching, shortest edges first
+  qsort (e, edges, sizeof (struct rapid_edge), rapid_edge_cmp);
+  for (k = 0; k < edges; k++)
+    if (mate[e[k].a] < 0 && mate[e[k].b] < 0)
+      {
+	mate[e[k].a] = e[k].b;
+	mate[e[k].b] = e[k].a;
+      }
+
+  // pair rest of nodes by nearest neighbour chain
+  for (j = 0, i = 0; i < n; i++)
+    if (mate[i] < 0)
+      {
+	odd[j] = odd[i];	// odd[] is rebuilt below
+	order[j++] = i;
+      }
+  if (j)
+    {
+      dh_grid_build (&grid, odd, order, j);
+      for (k = 0; k < j; k++)
+	{
+	  a = order[k];
+	  if (mate[a] >= 0)
+	    continue;
+	  dh_grid_remove (&grid, odd[k]);
+	  mg = dh_grid_nearest (&grid, odd[k], &len);
+	  if (!mg)
+	    break;
+	  dh_grid_remove (&grid, mg);
+	  for (b = k + 1; odd[b] != mg; b++);
+	  b = order[b];
+	  mate[a] = b;
+	  mate[b] = a;
+	}
+    }
+  dh_grid_free (&grid);
+  for (n = 0, mg = image->first_mg; mg != NULL; mg = mg->next)
+    if (mg->count & 1)
+      odd[n++] = mg;
+
+  greedy = rapid_sum (odd, mate, n);
+
+  // drake-hougardy pairing (from rapid pointers, dh = index + 1)
+  drake_hougardy (image, count);
+  for (i = 0; i < n; i++)
+    odd[i]->dh = i + 1;
+  for (dh = 0, i = 0; i < n; i++)
+    if (!odd[i]->rapid || (dh_mate[i] = odd[i]->rapid->dh - 1) < 0)
+      dh = DBL_MAX;
+  if (dh == 0)
+    dh = rapid_sum (odd, dh_mate, n);
+  if (dh < greedy)
+    memcpy (mate, dh_mate, n * sizeof (int));
+  for (mg = image->first_mg; mg != NULL; mg = mg->next)
+    mg->rapid = NULL;
+
+  // 2-opt
+  for (flag = 1; flag;)
+    {
+      flag = 0;
+      passes++;
+      for (a = 0; a < n; a++)
+	{
+	  if ((a & 255) == 0)
+	    {
+	      clock_gettime (CLOCK_MONOTONIC, &ts);
+	      ms = (ts.tv_sec - ts_start.tv_sec) * 1000 +
+		(ts.tv_nsec - ts_start.tv_nsec) / 1000000;
+	      if (ms >= image->rapid_time)
+		{
+		  flag = 0;
+		  break;
+		}
+	    }
+	  b = mate[a];
+	  if (b < 0)
+	    continue;
+	  for (k = 0; k < nbc[a]; k++)
+	    {
+	      c = nb[a * RAPID_KNN + k];
+	      d = mate[c];
+	      if (c == b || d < 0)
+		continue;
+	      if (rapid_len (odd[a], odd[b]) + rapid_len (odd[c], odd[d]) >
+		  rapid_len (odd[a], odd[c]) + rapid_len (odd[b], odd[d]) +
+		  1e-9)
+		{
+		  mate[a] = c;
+		  mate[c] = a;
+		  mate[b] = d;
+		  mate[d] = b;
+		  b = c;
+		  swaps++;
+		  flag = 1;
+		}
+	    }
+	}
+    }
+  sum = rapid_sum (odd, mate, n);
+  printf
+    ("rapid pairing length greedy %f, drake-hougardy %f, 2-opt %f (%d swaps, %d passes)\n",
+     greedy, dh, sum, swaps, passes);
+
+  for (i = 0; i < n; i++)
+    {
+      odd[i]->dh = 1;
+      if (mate[i] >= 0)
+	odd[i]->rapid = odd[mate[i]];
+    }
+  free (odd);
+  free (order);
+  free (mate);
+  free (dh_mate);
+  free (nb);
+  free (nbc);
+  free (dist);
+  free (e);
+  return sum;
+}
+
 /*
  polylines is real path for routing PCB division lines, but in nodes with 
  odd edges  rapids is needed. This procedure uses drake-hougardy minimal pairing
@@ -210,7 +725,10 @@ add_rapids (struct image *image)
 
   for (count = 0, mg = image->first_mg; mg != NULL; count++, mg = mg->next);
 
-  drake_hougardy (image, count);
+  if (image->rapid_engine == 1)
+    rapid_greedy (image, count);
+  else
+    drake_hougardy (image, count);
 
   for (count = 1, mg = image->first_mg; mg != NULL; count++, mg = mg->next)
     {
@@ -232,37 +750,87 @@ add_rapids (struct image *image)
 
 //return start point for graph draw 
 
-static struct multigraph *
-next_point (struct image *image, double x, double y)
+static double
+next_point_len (struct multigraph *mg, double x, double y)
 {
+  double len;
 
-  double min = DBL_MAX, tmp_min;
-  struct multigraph *mg, *start = NULL;
+  len = sqrt ((mg->rx - x) * (mg->rx - x) + (mg->ry - y) * (mg->ry - y));
 
-  for (mg = image->first_mg; mg != NULL; mg = mg->next)
+  //this rapid is not needed to go if this point is used as start
+  if (mg->rapid)
     {
-      if (mg->used)
-	continue;
-
-      tmp_min =
-	sqrt ((mg->rx - x) * (mg->rx - x) + (mg->ry - y) * (mg->ry - y));
-
-      //this rapid is not needed to go if this point is used as start
-      if (mg->rapid)
-	{
-	  tmp_min -= sqrt ((mg->rx - mg->rapid->rx) * (mg->rx -
-						       mg->rapid->rx) +
-			   (mg->ry - mg->rapid->ry) * (mg->ry -
-						       mg->rapid->ry));
-	}
+      len -= sqrt ((mg->rx - mg->rapid->rx) * (mg->rx -
+					       mg->rapid->rx) +
+		   (mg->ry - mg->rapid->ry) * (mg->ry - mg->rapid->ry));
+    }
+  return len;
+}
 
-      if (tmp_min <= min)
+/*
+  unused nodes are in grid, used nodes are removed from grid when found.
+  rapid_max (longest rapid in grid at build time) limits how much can be
+  saved by rapid, search stops if next ring of cells cannot contain
+  better start point. For same length last node in list is used.
+*/
+static struct multigraph *
+next_point (struct dh_grid *g, double rapid_max, double x, double y,
+	    double *score)
+{
+  double min = DBL_MAX, tmp_min;
+  struct multigraph *mg, *start = NULL;
+  int start_order = -1;
+  int c, cx, cy, r, sx, sy, k, last;
+
+  *score = DBL_MAX;
+  if (!g->live)
+    return NULL;
+  c = dh_cell (g, x, y);
+  cx = c % g->nx;
+  cy = c / g->nx;
+  for (r = 0; r < g->nx || r < g->ny; r++)
+    {
+      for (sy = cy - r; sy <= cy + r; sy++)
 	{
-	  min = tmp_min;
-	  start = mg;
+	  if (sy < 0 || sy >= g->ny)
+	    continue;
+	  for (sx = cx - r; sx <= cx + r;
+	       sx += (sy == cy - r || sy == cy + r) ? 1 : 2 * r)
+	    {
+	      if (sx >= 0 && sx < g->nx)
+		{
+		  c = sx + sy * g->nx;
+		  for (k = g->start[c]; k < g->start[c] + g->cnt[c];)
+		    {
+		      mg = g->node[k];
+		      if (mg->used)
+			{
+			  last = g->start[c] + --g->cnt[c];
+			  g->node[k] = g->node[last];
+			  g->order[k] = g->order[last];
+			  g->live--;
+			  continue;
+			}
+		      tmp_min = next_point_len (mg, x, y);
+		      if (tmp_min < min
+			  || (tmp_min == min && g->order[k] > start_order))
+			{
+			  min = tmp_min;
+			  start = mg;
+			  start_order = g->order[k];
+			}
+		      k++;
+		    }
+		}
+	      if (r == 0)
+		break;
+	    }
 	}
+      if (start && min < (r * g->cell - rapid_max) * (1 - 1e-9) - 1e-9)
+	break;
     }
-
+  dh_grid_compact (g);
+  *score = min;
   return start;
 }
 
@@ -278,6 +846,7 @@ create_graph_node (struct image *image, int x, int y)
   mg->y = y;
   mg->rx = i2realX (image, x) / 2.0;
   mg->ry = i2realY (image, y) / 2.0;
+  mg_hash_insert (mg);
   return mg;
 }
 
@@ -340,21 +909,31 @@ create_graph (struct image *image)
     }
 }
 
+// route to point p, segment from previous point prev can be arc
+static void
+route_point (struct image *image, struct polyline_point *prev,
+	     struct polyline_point *p)
+{
+  image->route_last_x = i2realX (image, p->x) / 2.0;
+  image->route_last_y = i2realY (image, p->y) / 2.0;
+  if (prev && prev->arc)
+    postprocesor_route_arc (image->route_last_x, image->route_last_y,
+			    prev->arc_cx, prev->arc_cy, prev->arc);
+  else
+    postprocesor_route (image->route_last_x, image->route_last_y);
+}
+
 static int
 path_dump (struct polyline *ps, struct image *image, int g)
 {
   int count = 0;
-  struct polyline_point *p;
+  struct polyline_point *p, *prev = NULL;
 
-  for (p = ps->points; p != NULL; p = p->next)
+  for (p = ps->points; p != NULL; prev = p, p = p->next)
     {
       count++;
       if (g)
-	{
-	  image->route_last_x = i2realX (image, p->x) / 2.0;
-	  image->route_last_y = i2realY (image, p->y) / 2.0;
-	  postprocesor_route (image->route_last_x, image->route_last_y);
-	}
+	route_point (image, prev, p);
       if (p->next == NULL)
 	{
 	  if (p->x != p->head->end_x || p->y != p->head->end_y)
@@ -374,17 +953,39 @@ struct g_data
   struct multigraph *self;	//pointer to self
   struct multigraph *node;	//to this node
   struct polyline *edge;	//by this edge (if path is missing, use rapid)
-  struct g_data *next;
 };
 
-static struct g_data *
-euler (struct image *image, struct multigraph *mg)
+/*
+  euler tour work space, allocated in first call and reused (only grows)
+  g_step - steps in order as found by euler()
+  g_stack - steps to be scanned (index to g_step)
+  g_tour - final tour (index to g_step)
+*/
+static struct g_data *g_step;
+static int *g_stack, *g_tour;
+static int g_size;
+
+static int
+g_new (int steps)
+{
+  if (steps == g_size)
+    {
+      g_size = g_size ? g_size * 2 : 1024;
+      g_step = realloc (g_step, g_size * sizeof (struct g_data));
+      g_stack = realloc (g_stack, g_size * sizeof (int));
+      g_tour = realloc (g_tour, g_size * sizeof (int));
+    }
+  return steps;
+}
+
+// one step from node mg (unused edge or rapid), 0 if no step exists
+static int
+euler (struct image *image, struct multigraph *mg, struct g_data *last_g)
 {
-  struct g_data *last_g;
   int i;
 
-  last_g = calloc (sizeof (struct g_data), 1);
   last_g->self = mg;
+  last_g->edge = NULL;
 
   for (i = 0; i < 4; i++)
     {
@@ -405,8 +1006,7 @@ euler (struct image *image, struct multigraph *mg)
 	  last_g->node->count--;
 	  DPRINT ("selected node %p by path %p\n", last_g->node,
 		  last_g->edge);
-	  mg = last_g->node;
-	  return last_g;
+	  return 1;
 	}
     }
   if (mg->rapid)		//exist rapid ?
@@ -414,88 +1014,401 @@ euler (struct image *image, struct multigraph *mg)
       DPRINT ("selected node %p rapid\n", mg->rapid);
       last_g->node = mg->rapid;
       mg->rapid = NULL;
-      mg = last_g->node;
-      mg->rapid = NULL;
-      return last_g;
+      last_g->node->rapid = NULL;
+      return 1;
     }
-
-  free (last_g);
-  return NULL;
+  return 0;
 }
 
+/*
+  Hierholzer: tour is scanned from start, if node of step has unused edges
+  (or rapid), closed walks from this node are inserted after this step
+  (last found walk first). Each edge/rapid is used exactly once. Steps
+  to scan are on stack, walks are pushed in reverse order.
+*/
 static void
 dump_graph_component (struct image *image, struct multigraph *mg)
 {
-  int i = 0;
-  struct g_data *first_g = NULL;
-  struct g_data *last_g, *rest_g;
-
+  int steps = 0, sp = 0, tour = 0;
+  int i, e, w, first = 1;
+  int *tail = NULL, tail_len = 0;
+  struct multigraph *node;
 
   postprocesor_write_comment (" === ROUTING GRAPH COMPONENT === ");
 
-  postprocesor_rapid (i2realX (image, mg->x) / 2.0,
-		      i2realY (image, mg->y) / 2.0);
+  image->route_last_x = i2realX (image, mg->x) / 2.0;
+  image->route_last_y = i2realY (image, mg->y) / 2.0;
+  postprocesor_rapid (image->route_last_x, image->route_last_y);
 
-  first_g = euler (image, mg);
+  g_new (steps);
+  if (euler (image, mg, &g_step[steps]))
+    g_stack[sp++] = steps++;
 
-  for (last_g = first_g; last_g != NULL; last_g = last_g->next)
+  for (;;)
     {
-      if (last_g->node->count || (last_g->node->rapid))
+      while (sp)
 	{
-	  i++;
-	  DPRINT ("euler interation %d\n", i);
-	  rest_g = last_g->next;
-	  for (;;)
+	  e = g_stack[--sp];
+	  g_tour[tour++] = e;
+	  while (g_step[e].node->count || g_step[e].node->rapid)
 	    {
-	      mg = last_g->node;
-	      DPRINT ("going to node [%p] at %d %d  count %d\n", mg, mg->x,
-		      mg->y, mg->count);
-	      last_g->next = euler (image, mg);
-	      if (!(last_g->next))
+	      DPRINT ("euler walk from %p\n", g_step[e].node);
+	      for (w = steps, node = g_step[e].node;; steps++)
 		{
-		  last_g->next = rest_g;
-		  last_g = first_g;
-		  break;
+		  g_new (steps);
+		  if (!euler (image, node, &g_step[steps]))
+		    break;
+		  node = g_step[steps].node;
 		}
-	      last_g = last_g->next;
+	      if (w == steps)
+		break;
+	      for (i = steps - 1; i >= w; i--)
+		g_stack[sp++] = i;
+	      // first step is checked only once
+	      if (first)
+		break;
 	    }
-
+	  first = 0;
 	}
+      // first step is checked only once, if it still has edges (this
+      // happens if start node has two edges), scan it again and append
+      // old tour
+      if (tail || !tour || !(g_step[g_tour[0]].node->count
+			     || g_step[g_tour[0]].node->rapid))
+	break;
+      tail_len = tour - 1;
+      tail = malloc ((tail_len + 1) * sizeof (int));
+      memcpy (tail, g_tour + 1, tail_len * sizeof (int));
+      g_stack[sp++] = g_tour[0];
+      tour = 0;
     }
-  for (last_g = first_g; last_g != NULL; last_g = last_g->next)
-    if (last_g->node->count)
+  if (tail)
+    {
+      memcpy (g_tour + tour, tail, tail_len * sizeof (int));
+      tour += tail_len;
+      free (tail);
+    }
+
+  for (i = 0; i < tour; i++)
+    if (g_step[g_tour[i]].node->count)
       {
-	printf ("Error, euler in %p count %d rapid %p\n", last_g->node,
-		last_g->node->count, last_g->node->rapid);
+	printf ("Error, euler in %p count %d rapid %p\n",
+		g_step[g_tour[i]].node, g_step[g_tour[i]].node->count,
+		g_step[g_tour[i]].node->rapid);
 	exit (1);
       }
 
-  for (last_g = first_g; last_g != NULL; last_g = last_g->next)
+  for (i = 0; i < tour; i++)
     {
-      if (last_g->node)
+      node = g_step[g_tour[i]].node;
+      node->used = 1;
+      if (g_step[g_tour[i]].edge)
+	path_dump (g_step[g_tour[i]].edge, image, 1);
+      else
 	{
-	  last_g->node->used = 1;
-	  if (last_g->edge)
-	    path_dump (last_g->edge, image, 1);
-	  else
-	    postprocesor_rapid (i2realX (image, last_g->node->x / 2.0),
-				i2realY (image, last_g->node->y / 2.0));
+	  image->route_last_x = i2realX (image, node->x / 2.0);
+	  image->route_last_y = i2realY (image, node->y / 2.0);
+	  postprocesor_rapid (image->route_last_x, image->route_last_y);
 	}
     }
+}
 
-  while (first_g)
+/*
+  closed loop = node with one closed polyline and nothing else, this loop
+  can be routed from any point of polyline
+*/
+struct route_loop
+{
+  struct multigraph *mg;
+  double xmin, xmax, ymin, ymax;	//bounding box in real units
+};
+
+static int
+is_loop (struct multigraph *mg)
+{
+  struct polyline *p = mg->edge[0];
+
+  return mg->count == 2 && p && !mg->edge[1] && !mg->rapid
+    && p->points->x == mg->x && p->points->y == mg->y
+    && p->end_x == mg->x && p->end_y == mg->y && p->points->next
+    && p->points->next->next;
+}
+
+// point of loop nearest to x,y
+static struct polyline_point *
+loop_entry (struct image *image, struct route_loop *l, double x, double y,
+	    double *dist)
+{
+  struct polyline_point *p, *entry = NULL;
+  double px, py, len;
+
+  *dist = DBL_MAX;
+  for (p = l->mg->edge[0]->points; p->next; p = p->next)
     {
-      rest_g = first_g->next;
-      free (first_g);
-      first_g = rest_g;
+      px = i2realX (image, p->x) / 2.0;
+      py = i2realY (image, p->y) / 2.0;
+      len = sqrt ((px - x) * (px - x) + (py - y) * (py - y));
+      if (len < *dist)
+	{
+	  *dist = len;
+	  entry = p;
+	}
     }
+  return entry;
+}
+
+// distance from x,y to loop bounding box
+static double
+loop_box_dist (struct route_loop *l, double x, double y)
+{
+  double dx = 0, dy = 0;
+
+  if (x < l->xmin)
+    dx = l->xmin - x;
+  else if (x > l->xmax)
+    dx = x - l->xmax;
+  if (y < l->ymin)
+    dy = l->ymin - y;
+  else if (y > l->ymax)
+    dy = y - l->ymax;
+  return sqrt (dx * dx + dy * dy);
+}
+
+/*
+  uniform grid over closed loops, loop is in all cells covered by its
+  bounding box. Routed loops (mg->used) are removed from cells when
+  found, loop in more cells is tested once in one search (seen).
+  List of unused loops is kept too (routed loop is replaced by last one),
+  for same length first loop in this list is used.
+*/
+struct loop_grid
+{
+  double x0, y0, cell;
+  int nx, ny;
+  int *start;			// first loop in cell
+  int *cnt;			// live loops in cell
+  int *item;			// loop indexes
+  int *seen;			// search number of last test
+  int search;
+  int *pos;			// position of loop in list of unused loops
+  int *at;			// loop at position
+  int live;
+};
+
+static void
+loop_grid_cell (struct loop_grid *g, double x, double y, int *cx, int *cy)
+{
+  *cx = (x - g->x0) / g->cell;
+  *cy = (y - g->y0) / g->cell;
+  if (*cx < 0)
+    *cx = 0;
+  if (*cx >= g->nx)
+    *cx = g->nx - 1;
+  if (*cy < 0)
+    *cy = 0;
+  if (*cy >= g->ny)
+    *cy = g->ny - 1;
+}
+
+static void
+loop_grid_build (struct loop_grid *g, struct route_loop *loop, int loops)
+{
+  double x1, y1, w, h;
+  int i, c, x, y, x0, y0, x1c, y1c, *pos;
+
+  g->x0 = loop[0].xmin;
+  g->y0 = loop[0].ymin;
+  x1 = loop[0].xmax;
+  y1 = loop[0].ymax;
+  for (i = 1; i < loops; i++)
+    {
+      if (g->x0 > loop[i].xmin)
+	g->x0 = loop[i].xmin;
+      if (x1 < loop[i].xmax)
+	x1 = loop[i].xmax;
+      if (g->y0 > loop[i].ymin)
+	g->y0 = loop[i].ymin;
+      if (y1 < loop[i].ymax)
+	y1 = loop[i].ymax;
+    }
+  w = x1 - g->x0;
+  h = y1 - g->y0;
+  // about one loop in one cell
+  g->cell = sqrt (w * h / loops);
+  if (g->cell < (w > h ? w : h) / loops)
+    g->cell = (w > h ? w : h) / loops;
+  if (g->cell <= 0)
+    g->cell = 1;
+  g->nx = w / g->cell + 1;
+  g->ny = h / g->cell + 1;
+
+  g->start = calloc (g->nx * g->ny + 1, sizeof (int));
+  g->cnt = calloc (g->nx * g->ny, sizeof (int));
+  for (i = 0; i < loops; i++)
+    {
+      loop_grid_cell (g, loop[i].xmin, loop[i].ymin, &x0, &y0);
+      loop_grid_cell (g, loop[i].xmax, loop[i].ymax, &x1c, &y1c);
+      for (y = y0; y <= y1c; y++)
+	for (x = x0; x <= x1c; x++)
+	  g->cnt[x + y * g->nx]++;
+    }
+  for (c = 0; c < g->nx * g->ny; c++)
+    g->start[c + 1] = g->start[c] + g->cnt[c];
+  g->item = malloc ((g->start[g->nx * g->ny] + 1) * sizeof (int));
+  pos = malloc (g->nx * g->ny * sizeof (int));
+  memcpy (pos, g->start, g->nx * g->ny * sizeof (int));
+  for (i = 0; i < loops; i++)
+    {
+      loop_grid_cell (g, loop[i].xmin, loop[i].ymin, &x0, &y0);
+      loop_grid_cell (g, loop[i].xmax, loop[i].ymax, &x1c, &y1c);
+      for (y = y0; y <= y1c; y++)
+	for (x = x0; x <= x1c; x++)
+	  g->item[pos[x + y * g->nx]++] = i;
+    }
+  free (pos);
+  g->seen = calloc (loops, sizeof (int));
+  g->search = 0;
+  g->pos = malloc (loops * sizeof (int));
+  g->at = malloc (loops * sizeof (int));
+  for (i = 0; i < loops; i++)
+    g->pos[i] = g->at[i] = i;
+  g->live = loops;
+}
+
+// loop i is routed
+static void
+loop_grid_remove (struct loop_grid *g, int i)
+{
+  int p = g->pos[i];
+
+  g->at[p] = g->at[--g->live];
+  g->pos[g->at[p]] = p;
+}
+
+static void
+loop_grid_free (struct loop_grid *g)
+{
+  free (g->start);
+  free (g->cnt);
+  free (g->item);
+  free (g->seen);
+  free (g->pos);
+  free (g->at);
+}
+
+/*
+  point of unused loop nearest to x,y if it is nearer than *min (*min and
+  *lmin are updated), otherwise NULL. Search stops if next ring of cells
+  cannot contain nearer loop.
+*/
+static struct polyline_point *
+loop_grid_nearest (struct image *image, struct loop_grid *g,
+		   struct route_loop *loop, double x, double y, double *min,
+		   struct route_loop **lmin)
+{
+  struct polyline_point *p, *entry = NULL;
+  struct route_loop *l;
+  int cx, cy, r, sx, sy, c, k, last, i, best = -1;
+  double len;
+
+  if (!g->start)
+    return NULL;
+  g->search++;
+  loop_grid_cell (g, x, y, &cx, &cy);
+  for (r = 0; r < g->nx || r < g->ny; r++)
+    {
+      for (sy = cy - r; sy <= cy + r; sy++)
+	{
+	  if (sy < 0 || sy >= g->ny)
+	    continue;
+	  for (sx = cx - r; sx <= cx + r;
+	       sx += (sy == cy - r || sy == cy + r) ? 1 : 2 * r)
+	    {
+	      if (sx >= 0 && sx < g->nx)
+		{
+		  c = sx + sy * g->nx;
+		  for (k = g->start[c]; k < g->start[c] + g->cnt[c];)
+		    {
+		      i = g->item[k];
+		      l = &loop[i];
+		      if (l->mg->used)
+			{
+			  last = g->start[c] + --g->cnt[c];
+			  g->item[k] = g->item[last];
+			  continue;
+			}
+		      k++;
+		      if (g->seen[i] == g->search)
+			continue;
+		      g->seen[i] = g->search;
+		      if (loop_box_dist (l, x, y) > *min)
+			continue;
+		      p = loop_entry (image, l, x, y, &len);
+		      if (len < *min || (best >= 0 && len == *min
+					 && g->pos[i] < g->pos[best]))
+			{
+			  *min = len;
+			  *lmin = l;
+			  entry = p;
+			  best = i;
+			}
+		    }
+		}
+	      if (r == 0)
+		break;
+	    }
+	}
+      // loops not tested yet are more than r cells away
+      if (r * g->cell > *min)
+	break;
+    }
+  return entry;
+}
+
+// route closed loop, start and end at entry point
+static void
+dump_loop (struct image *image, struct multigraph *mg,
+	   struct polyline_point *entry)
+{
+  struct polyline *pl = mg->edge[0];
+  struct polyline_point *p, *prev = NULL;
+
+  postprocesor_write_comment (" === ROUTING GRAPH COMPONENT === ");
+  image->route_last_x = i2realX (image, entry->x) / 2.0;
+  image->route_last_y = i2realY (image, entry->y) / 2.0;
+  postprocesor_rapid (image->route_last_x, image->route_last_y);
+  if (entry == pl->points)
+    path_dump (pl, image, 1);
+  else
+    {
+      // entry .. end, then start (same as end) .. entry
+      // last point is same as start point, arc to start->next is in start
+      p = entry;
+      do
+	{
+	  route_point (image, prev, p);
+	  prev = p->next ? p : pl->points;
+	  p = prev->next;
+	}
+      while (p != entry);
+      route_point (image, prev, entry);
+    }
+  pl->used = 1;
+  mg->count = 0;
+  mg->used = 1;
 }
 
 static void
 optimized_dump (struct image *image)
 {
 
-  struct multigraph *mg;
+  struct multigraph *mg, **node;
+  struct dh_grid grid = { 0 };
+  struct loop_grid lgrid = { 0 };
+  struct route_loop *loop, *l = NULL;
+  struct polyline_point *p, *loop_min;
+  int *order, n, count, loops;
+  double rapid_max = 0, len, min, x, y, px, py;
 
   create_graph (image);
   add_rapids (image);
@@ -508,27 +1421,87 @@ optimized_dump (struct image *image)
   image->drill_last_x = 0;
   image->drill_last_y = 0;
 
-  // first dump circles
-  for (mg = image->first_mg; mg != NULL; mg = mg->next)
-    if (mg->count == 2 && mg->used == 0)
-      {
-	//TODO rotate circle to get point in mg at shortest path to etching tool
-	dump_graph_component (image, mg);
-	//TODO update image->drill_last_x,y
-      }
-
-  //get start point for routing
-  while ((mg = next_point (image, image->drill_last_x, image->drill_last_y)))
+  // closed loops are routed from point nearest to tool, other components
+  // from nearest unused node (both in grid)
+  for (count = 0, mg = image->first_mg; mg != NULL; count++, mg = mg->next);
+  node = malloc ((count + 1) * sizeof (struct multigraph *));
+  order = malloc ((count + 1) * sizeof (int));
+  loop = malloc ((count + 1) * sizeof (struct route_loop));
+  for (n = 0, loops = 0, count = 0, mg = image->first_mg; mg != NULL;
+       count++, mg = mg->next)
     {
-      //clear rapids at both nodes of this subgraph
+      if (mg->used)
+	continue;
+      if (is_loop (mg))
+	{
+	  l = &loop[loops++];
+	  l->mg = mg;
+	  l->xmin = l->xmax = mg->rx;
+	  l->ymin = l->ymax = mg->ry;
+	  for (p = mg->edge[0]->points; p; p = p->next)
+	    {
+	      px = i2realX (image, p->x) / 2.0;
+	      py = i2realY (image, p->y) / 2.0;
+	      if (l->xmin > px)
+		l->xmin = px;
+	      if (l->xmax < px)
+		l->xmax = px;
+	      if (l->ymin > py)
+		l->ymin = py;
+	      if (l->ymax < py)
+		l->ymax = py;
+	    }
+	  continue;
+	}
+      node[n] = mg;
+      order[n++] = count;
       if (mg->rapid)
-	mg->rapid->rapid = NULL;
-      mg->rapid = NULL;
-      DPRINT ("starting at [%p] %d %d count=%d\n", mg, mg->x, mg->y,
-	      mg->count);
-      dump_graph_component (image, mg);
-      //TODO update image->drill_last_x,y
+	{
+	  len = sqrt ((mg->rx - mg->rapid->rx) * (mg->rx - mg->rapid->rx) +
+		      (mg->ry - mg->rapid->ry) * (mg->ry - mg->rapid->ry));
+	  if (rapid_max < len)
+	    rapid_max = len;
+	}
+    }
+  if (n)
+    dh_grid_build (&grid, node, order, n);
+  if (loops)
+    loop_grid_build (&lgrid, loop, loops);
+  free (node);
+  free (order);
+
+  //get start point for routing, from last tool position
+  for (;;)
+    {
+      x = image->drill_last_x;
+      y = image->drill_last_y;
+      mg = next_point (&grid, rapid_max, x, y, &min);
+
+      // nearest loop, if it is nearer than start of other component
+      loop_min = loop_grid_nearest (image, &lgrid, loop, x, y, &min, &l);
+      if (loop_min)
+	{
+	  dump_loop (image, l->mg, loop_min);
+	  loop_grid_remove (&lgrid, l - loop);
+	}
+      else if (mg)
+	{
+	  //clear rapids at both nodes of this subgraph
+	  if (mg->rapid)
+	    mg->rapid->rapid = NULL;
+	  mg->rapid = NULL;
+	  DPRINT ("starting at [%p] %d %d count=%d\n", mg, mg->x, mg->y,
+		  mg->count);
+	  dump_graph_component (image, mg);
+	}
+      else
+	break;
+      image->drill_last_x = image->route_last_x;
+      image->drill_last_y = image->route_last_y;
     }
+  free (loop);
+  dh_grid_free (&grid);
+  loop_grid_free (&lgrid);
 
 
   postprocesor_write_comment (" === ROUTING end === ");
@@ -548,6 +1521,9 @@ free_multigraph (struct image *image)
       free (mg);
       mg = image->first_mg;
     }
+  free (mg_hash);
+  mg_hash = NULL;
+  mg_hash_size = mg_hash_count = 0;
 }
 
 void
@@ -555,6 +1531,7 @@ dump_lines (struct image *image)
 {
   debug_level = 1;
   optim (image);
+  arc_fit (image);
   optimized_dump (image);
   polyline_free_all (image);
   free_multigraph (image);